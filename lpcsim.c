@@ -0,0 +1,1247 @@
+/*----------------------------------------------------------------------------/
+/  LPCSIM - LPC ISP target simulator for LPCSP for POSIX
+/-----------------------------------------------------------------------------/
+/ LPCSIM creates a pseudo-terminal and serves the LPC ISP protocol spoken by
+/ LPCSP on it, so that the programmer can be tested without a physical board.
+/ It is a Free Software opened under license policy of GNU GPL.
+*/
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+
+#define LD_DWORD(ptr) (uint32_t)(((uint32_t)*((uint8_t*)(ptr)+3)<<24)|((uint32_t)*((uint8_t*)(ptr)+2)<<16)|((uint16_t)*((uint8_t*)(ptr)+1)<<8)|*(uint8_t*)(ptr))
+#define ST_DWORD(ptr,val) *(uint8_t*)(ptr)=(uint8_t)(val); *((uint8_t*)(ptr)+1)=(uint8_t)((uint16_t)(val)>>8); *((uint8_t*)(ptr)+2)=(uint8_t)((uint32_t)(val)>>16); *((uint8_t*)(ptr)+3)=(uint8_t)((uint32_t)(val)>>24)
+
+/* ISP return codes */
+#define CMD_SUCCESS		0
+#define INVALID_COMMAND	1
+#define SRC_ADDR_ERROR	2
+#define DST_ADDR_ERROR	3
+#define COUNT_ERROR		6
+#define INVALID_SECTOR	7
+#define SECTOR_NOT_BLANK	8
+#define SECTOR_NOT_PREPARED	9
+#define COMPARE_ERROR	10
+#define BUSY			11
+#define PARAM_ERROR		12
+#define ADDR_ERROR		13
+#define ADDR_NOT_MAPPED	14
+#define CMD_LOCKED		15
+#define INVALID_CODE	16
+
+
+typedef struct {
+	const char* DeviceName;	/* Device name LPC<string> */
+	uint32_t Sign;				/* Device signature value */
+	uint32_t RawMode;			/* UU-Encode(0) or Raw(1) for data transfer */
+	uint32_t FlashSize;		/* User flash memory size */
+	const uint32_t* SectMap;	/* Flash sector organization */
+	uint32_t RamAddr;			/* RAM base address */
+	uint32_t RamSize;			/* RAM size */
+	uint32_t IspRam;			/* RAM area reserved by the boot loader at bottom */
+	uint32_t MaxCopy;			/* Largest byte count of a C command */
+	uint32_t Cmds;				/* Supported optional commands (b0:S, b1:N) */
+	uint32_t Sum;				/* Application check sum address */
+	uint32_t IapEntry;			/* IAP entry address */
+	uint32_t IspClock;			/* CPU clock frequency in ISP mode [kHz] (0:oscillator) */
+} TARGET;
+
+
+/* Flash sector organizations (same as lpcsp.c) */
+const uint32_t Map1[] = { 0x0000, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x10000, 0x18000, 0x20000, 0x28000, 0x30000, 0x38000, 0x40000, 0x48000, 0x50000, 0x58000, 0x60000, 0x68000, 0x70000, 0x78000, 0x79000, 0x7A000, 0x7B000, 0x7C000, 0x7D000, 0x7E000, 0x7F000, 0x80000 };
+const uint32_t Map4[] = { 0x0000, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x9000, 0xA000, 0xB000, 0xC000, 0xD000, 0xE000, 0xF000, 0x10000, 0x18000, 0x20000, 0x28000, 0x30000, 0x38000, 0x40000, 0x48000, 0x50000, 0x58000, 0x60000, 0x68000, 0x70000, 0x78000, 0x80000 };
+const uint32_t Map5[] = { 0x0000, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x9000, 0xA000, 0xB000, 0xC000, 0xD000, 0xE000, 0xF000, 0x10000, 0x11000, 0x12000, 0x13000, 0x14000, 0x15000, 0x16000, 0x17000, 0x18000, 0x19000, 0x1A000, 0x1B000, 0x1C000, 0x1D000, 0x1E000, 0x1F000, 0x20000, 0x21000, 0x22000, 0x23000, 0x24000, 0x25000, 0x26000, 0x27000, 0x28000, 0x29000, 0x2A000, 0x2B000, 0x2C000, 0x2D000, 0x2E000, 0x2F000, 0x30000, 0x31000, 0x32000, 0x33000, 0x34000, 0x35000, 0x36000, 0x37000, 0x38000, 0x39000, 0x3A000, 0x3B000, 0x3C000, 0x3D000, 0x3E000, 0x3F000, 0x40000 };
+const uint32_t Map6[] = { 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00, 0x2000, 0x2400, 0x2800, 0x2C00, 0x3000, 0x3400, 0x3800, 0x3C00, 0x4000, 0x4400, 0x4800, 0x4C00, 0x5000, 0x5400, 0x5800, 0x5C00, 0x6000, 0x6400, 0x6800, 0x6C00, 0x7000, 0x7400, 0x7800, 0x7C00, 0x8000, 0x8400, 0x8800, 0x8C00, 0x9000, 0x9400, 0x9800, 0x9C00, 0xA000, 0xA400, 0xA800, 0xAC00, 0xB000, 0xB400, 0xB800, 0xBC00, 0xC000, 0xC400, 0xC800, 0xCC00, 0xD000, 0xD400, 0xD800, 0xDC00, 0xE000, 0xE400, 0xE800, 0xEC00, 0xF000, 0xF400, 0xF800, 0xFC00, 0x10000 };
+
+/* One representative part of each family */
+const TARGET TgtLst[] = {
+/*	 *Device     Sign        Raw  Flash   *Map  RAM          Size    ISP    Copy  Cmds  Sum   IAP        Clock */
+	{ "812",    0x00008121, 1,  0x4000, Map6, 0x10000000, 0x1000, 0x300,  0x400, 3, 0x1C, 0x1FFF1FF1, 12000 },
+	{ "845",    0x00008451, 1, 0x10000, Map6, 0x10000000, 0x4000, 0x600,  0x400, 3, 0x1C, 0x0F001FF1, 12000 },
+	{ "1114",   0x0444102B, 0,  0x8000, Map5, 0x10000000, 0x2000, 0x200, 0x1000, 2, 0x1C, 0x1FFF1FF1, 12000 },
+	{ "1347",   0x08020543, 0, 0x10000, Map5, 0x10000000, 0x2000, 0x200, 0x1000, 2, 0x1C, 0x1FFF1FF1, 12000 },
+	{ "1549",   0x00001549, 1, 0x40000, Map5, 0x10000000, 0x9000, 0x200, 0x1000, 3, 0x1C, 0x03000205, 12000 },
+	{ "1768",   0x26013F37, 0, 0x80000, Map4, 0x10000000, 0x8000, 0x200, 0x1000, 2, 0x1C, 0x1FFF1FF1,  4000 },
+	{ "4088",   0x481D3F47, 1, 0x80000, Map4, 0x10000000, 0x10000, 0x200, 0x1000, 3, 0x1C, 0x1FFF1FF1, 12000 },
+	{ "2148",       196389, 0, 0x7D000, Map1, 0x40000000, 0x8000, 0x200, 0x1000, 0, 0x14, 0x7FFFFFF1,     0 },
+	{ "2378",    385940773, 0, 0x7E000, Map1, 0x40000000, 0x8000, 0x200, 0x1000, 2, 0x14, 0x7FFFFFF1,  4000 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+
+const TARGET *Target;	/* Simulated device */
+uint32_t Sign;			/* Signature returned on J command */
+uint8_t Flash[0x80000];	/* Flash memory */
+uint8_t Ram[0x10000];	/* On-chip RAM */
+uint64_t PrepMap;		/* Prepared sector map */
+int Echo;				/* Echo mode */
+
+int Pty = -1;			/* Master side of the pseudo-terminal */
+long ByteTime;			/* Transmission time per byte [us] (0:no delay) */
+long CmdLatency;		/* Processing latency per command [us] */
+long UsbLatency;		/* Round-trip latency of the USB-serial bridge [us] */
+long FaultRate;			/* Return BUSY on every n-th command (0:off) */
+long SyncDrop;			/* Number of sync requests to be ignored on each session */
+long BootTime;			/* Time to start the boot loader after the port is opened [ms] */
+long CorruptRate;		/* Flip a bit in the data of every n-th W command or write frame (every other frame: in the header) (0:off) */
+long WriteCount;		/* Number of W commands processed */
+int Verbose;			/* -v Trace commands */
+const char *DumpFile;	/* -o<file> Dump flash memory at end of each session */
+long CmdCount;			/* Number of commands processed in the session */
+
+uint8_t RxBuf[4096];	/* Receive buffer */
+int RxPtr, RxCnt;
+double RxTime;			/* Time when the data in the receive buffer arrived */
+double RxGap;			/* Idle time before the data in the receive buffer */
+
+
+
+/*-----------------------------------------------------------------------
+  Serial I/O over the pseudo-terminal
+-----------------------------------------------------------------------*/
+
+static
+double get_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static
+void wait_us (
+	long us
+)
+{
+	struct timespec ts;
+
+	if (us <= 0) return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR) ;
+}
+
+
+/* Get a byte from the host (-1:port closed) */
+static
+int get_byte (void)
+{
+	struct pollfd pfd;
+	int rc;
+
+
+	while (RxPtr >= RxCnt) {
+		pfd.fd = Pty; pfd.events = POLLIN;
+		rc = poll(&pfd, 1, 0);
+		if (rc == 0) {	/* Host is waiting for a response: charge a USB round trip */
+			rc = poll(&pfd, 1, -1);
+			if (rc > 0) wait_us(UsbLatency);
+		}
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (!(pfd.revents & POLLIN)) return -1;	/* Hung up */
+		rc = read(Pty, RxBuf, sizeof RxBuf);
+		if (rc <= 0) {
+			if (rc < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+			return -1;
+		}
+		wait_us(ByteTime * rc);	/* Time to receive these bytes */
+		RxPtr = 0; RxCnt = rc;
+		RxGap = get_time() - RxTime;
+		RxTime += RxGap;
+	}
+	return RxBuf[RxPtr++];
+}
+
+
+/* Get a line from the host (-1:port closed) */
+static
+int get_line (
+	char* buff,
+	int bufsize
+)
+{
+	int c, i = 0;
+
+
+	for (;;) {
+		c = get_byte();
+		if (c < 0) return -1;
+		if (c == '\n') break;
+		if (c == '\r') continue;
+		if (i < bufsize - 1) buff[i++] = (char)c;
+	}
+	buff[i] = 0;
+	return i;
+}
+
+
+static
+void put_data (
+	const void* data,
+	int len
+)
+{
+	const uint8_t *p = data;
+	int rc;
+
+
+	wait_us(ByteTime * len);	/* Time to transmit these bytes */
+	while (len > 0) {
+		rc = write(Pty, p, len);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				wait_us(1000);
+				continue;
+			}
+			return;
+		}
+		p += rc; len -= rc;
+	}
+}
+
+
+static
+void put_line (
+	const char* str
+)
+{
+	char buf[300];
+
+	snprintf(buf, sizeof buf, "%s\r\n", str);
+	put_data(buf, strlen(buf));
+}
+
+
+static
+void put_rc (
+	int rc
+)
+{
+	char buf[16];
+
+	sprintf(buf, "%d", rc);
+	put_line(buf);
+}
+
+
+
+/*-----------------------------------------------------------------------
+  Target model
+-----------------------------------------------------------------------*/
+
+static
+uint32_t crc32 (
+	const uint8_t* src,
+	unsigned int cnt
+)
+{
+	uint32_t r = 0xFFFFFFFF, n;
+
+	while (cnt--) {
+		r ^= *src++;
+		for (n = 0; n < 8; n++) r = r & 1 ? r >> 1 ^ 0xEDB88320 : r >> 1;
+	}
+	return ~r;
+}
+
+
+static
+void uuencode (
+	const uint8_t* bin,
+	int srcsize,
+	char* dst
+)
+{
+	uint8_t c1, c2, c3;
+	char c;
+
+
+	c = srcsize + 0x20;
+	*dst++ = (c == ' ') ? '`' : c;
+	for ( ; srcsize > 0; srcsize -= 3) {
+		c1 = *bin++;
+		c2 = (srcsize >= 2) ? *bin++ : 0;
+		c3 = (srcsize >= 3) ? *bin++ : 0;
+		c = (c1 >> 2) + 0x20; *dst++ = (c == ' ') ? '`' : c;
+		c = ((c1 & 3) << 4) + (c2 >> 4) + 0x20; *dst++ = (c == ' ') ? '`' : c;
+		c = ((c2 & 15) << 2) + (c3 >> 6) + 0x20; *dst++ = (c == ' ') ? '`' : c;
+		c = (c3 & 63) + 0x20; *dst++ = (c == ' ') ? '`' : c;
+	}
+	*dst = 0;
+}
+
+
+/* Returns number of bytes decoded (-1:error) */
+static
+int uudecode (
+	const char* src,
+	uint8_t* dst
+)
+{
+	uint8_t b[4];
+	int bc, cc, i;
+
+
+	if ((uint8_t)(*src - 0x20) > 64) return -1;
+	bc = (*src++ - 0x20) & 63;
+	for (cc = bc; cc > 0; cc -= 3) {
+		for (i = 0; i < 4; i++) {
+			b[i] = *src++ - 0x20;
+			if (b[i] > 64) return -1;
+			b[i] &= 63;
+		}
+		*dst++ = (b[0] << 2) | (b[1] >> 4);
+		if (cc >= 2) *dst++ = (b[1] << 4) | (b[2] >> 2);
+		if (cc >= 3) *dst++ = (b[2] << 6) | b[3];
+	}
+	return bc;
+}
+
+
+static
+int num_sect (void)
+{
+	int n;
+
+	for (n = 0; Target->SectMap[n] < Target->FlashSize; n++) ;
+	return n;
+}
+
+
+/* Get a pointer to the memory at the address (NULL:not mapped) */
+static
+uint8_t* mem_ptr (
+	uint32_t addr,
+	uint32_t size
+)
+{
+	if (addr + size <= Target->FlashSize) return &Flash[addr];
+	if (addr >= Target->RamAddr && addr + size <= Target->RamAddr + Target->RamSize) return &Ram[addr - Target->RamAddr];
+	return NULL;
+}
+
+
+/* Check if the RAM area can be written by W command */
+static
+int ram_writable (
+	uint32_t addr,
+	uint32_t size
+)
+{
+	return addr >= Target->RamAddr + Target->IspRam
+		&& addr + size <= Target->RamAddr + Target->RamSize - 0x120;	/* ISP stack at top of RAM */
+}
+
+
+/* Receive data to be written to RAM (W command) */
+static
+int rcvr_data (
+	uint8_t* dst,
+	uint32_t size
+)
+{
+	char line[128];
+	uint8_t bin[64];
+	uint32_t sum, xc;
+	int lc, n, err, c;
+
+
+	if (Target->RawMode) {
+		while (size--) {
+			if ((c = get_byte()) < 0) return -1;
+			*dst++ = (uint8_t)c;
+		}
+		return 0;
+	}
+
+	xc = 0;
+	while (xc < size) {
+		sum = 0; err = 0;
+		for (lc = 0; lc < 20 && xc + lc * 45 < size; lc++) {
+			if (get_line(line, sizeof line) < 0) return -1;
+			n = uudecode(line, bin);
+			if (n < 0 || xc + lc * 45 + n > size) {
+				err = 1;
+				continue;
+			}
+			memcpy(&dst[xc + lc * 45], bin, n);
+			while (n) sum += bin[--n];
+		}
+		if (get_line(line, sizeof line) < 0) return -1;
+		if (err || strtoul(line, NULL, 10) != sum) {
+			put_line("RESEND");
+		} else {
+			put_line("OK");
+			xc += lc * 45;
+		}
+	}
+	return 0;
+}
+
+
+/* Erase prepared sectors (E command and IAP) */
+static
+int erase_sect (	/* ISP return code */
+	uint32_t ss,	/* Start sector */
+	uint32_t es		/* End sector */
+)
+{
+	uint32_t s;
+
+
+	if (es < ss || (int)es >= num_sect()) return INVALID_SECTOR;
+	for (s = ss; s <= es; s++) {
+		if (!(PrepMap & 1ULL << s)) break;
+	}
+	if (s <= es) { PrepMap = 0; return SECTOR_NOT_PREPARED; }
+	for (s = ss; s <= es; s++) {
+		memset(&Flash[Target->SectMap[s]], 0xFF, Target->SectMap[s + 1] - Target->SectMap[s]);
+		wait_us(5000);	/* Sector erase time */
+	}
+	PrepMap = 0;
+	return CMD_SUCCESS;
+}
+
+
+/* Copy RAM to a prepared sector (C command and IAP) */
+static
+int copy_flash (	/* ISP return code */
+	uint32_t da,	/* Destination flash address */
+	uint32_t sa,	/* Source RAM address */
+	uint32_t sz		/* Byte count */
+)
+{
+	const uint8_t *src;
+	uint8_t *dst;
+	uint32_t s;
+
+
+	if (da & 0xFF || da + sz > Target->FlashSize) return DST_ADDR_ERROR;
+	if (sa & 3 || !(src = mem_ptr(sa, sz)) || sa < Target->RamAddr) return SRC_ADDR_ERROR;
+	if ((sz != 64 && sz != 128 && sz != 256 && sz != 512 && sz != 1024 && sz != 4096) || sz > Target->MaxCopy
+		|| (Target->MaxCopy > 0x400 && sz < 256)) {
+		return COUNT_ERROR;
+	}
+	for (s = 0; Target->SectMap[s + 1] <= da; s++) ;
+	if (!(PrepMap & 1ULL << s)) { PrepMap = 0; return SECTOR_NOT_PREPARED; }
+	dst = &Flash[da];
+	for (s = 0; s < sz; s++) dst[s] &= src[s];	/* Flash bits can only be cleared */
+	wait_us(sz);	/* Programming time (1us/byte) */
+	PrepMap = 0;
+	return CMD_SUCCESS;
+}
+
+
+/* Check if the line is idle for a while */
+static
+int rx_idle (	/* 1:no data arrived in the time */
+	int ms
+)
+{
+	struct pollfd pfd;
+
+
+	if (RxPtr < RxCnt) return 0;
+	pfd.fd = Pty; pfd.events = POLLIN;
+	return poll(&pfd, 1, ms) == 0;
+}
+
+
+/* Receive bytes of a frame for the flash write code */
+/* A gap in the frame is detected like the write code does */
+static
+int rcvr_frame (	/* 0:received, -1:port closed, 1:reset, 2:line idle in the frame */
+	uint8_t* dst,
+	uint32_t size,
+	int first		/* The first byte of a frame (reset is detected) */
+)
+{
+	int c;
+
+
+	while (size--) {
+		if (!first && rx_idle(100)) return 2;
+		if ((c = get_byte()) < 0) return -1;
+		if (first && c == '?' && RxPtr == 1 && RxGap > 0.05) return 1;	/* Reset by the host */
+		*dst++ = (uint8_t)c;
+		first = 0;
+	}
+	return 0;
+}
+
+
+/* Receive packed data of a frame and expand it like the write code does */
+/* Token 0-127 is followed by 1-128 literal bytes, token 128-255 copies 3-130 bytes from the distance in following 16-bit */
+static
+int rcvr_packed (	/* 0:received, -1:port closed, 2:broken data or line idle in the frame */
+	uint8_t* dst,		/* Buffer to store the expanded data */
+	uint32_t size,		/* Size of the expanded data */
+	uint8_t* pk,		/* Buffer to store the packed data (for CRC) */
+	uint32_t* pn		/* Size of the packed data received */
+)
+{
+	uint32_t i, n, len, d;
+	int rc;
+
+
+	for (i = n = 0; i < size; ) {
+		if ((rc = rcvr_frame(&pk[n], 1, 0)) != 0) return rc;
+		if (pk[n] < 128) {	/* Literals */
+			len = pk[n++] + 1;
+			if (len > size - i) return 2;
+			if ((rc = rcvr_frame(&pk[n], len, 0)) != 0) return rc;
+			memcpy(&dst[i], &pk[n], len);
+			n += len; i += len;
+		} else {			/* Match */
+			len = pk[n++] - 125;
+			if (len > size - i) return 2;
+			if ((rc = rcvr_frame(&pk[n], 2, 0)) != 0) return rc;
+			d = pk[n] | pk[n + 1] << 8;
+			n += 2;
+			if (d == 0 || d > i) return 2;
+			for ( ; len; len--, i++) dst[i] = dst[i - d];
+		}
+	}
+	*pn = n;
+	return 0;
+}
+
+
+/* Run the flash write code (binary frames {command, arg1, arg2, arg3, arg4, [data], CRC32} and IAP) */
+static
+int run_writer (	/* -1:port closed, 1:reset */
+	const uint8_t* code
+)
+{
+	uint8_t frm[20 + 0x2000 + 4], xb[0x1000], rep[8];
+	uint32_t cmd, a1, a2, a3, a4, ba, bs, fs, st, val, n, s;
+	int rc;
+
+
+	ba = LD_DWORD(&code[48]); bs = LD_DWORD(&code[52]); fs = LD_DWORD(&code[56]);
+	if (Verbose) fprintf(stderr, "lpcsim: flash write code started (buffer %X, %u bytes, frame %u bytes)\n", ba, bs, fs);
+	if (LD_DWORD(&code[40]) != Target->IapEntry || (Target->IspClock && LD_DWORD(&code[44]) != Target->IspClock)) {
+		fprintf(stderr, "lpcsim: wrong IAP entry %X or clock %u\n", LD_DWORD(&code[40]), LD_DWORD(&code[44]));
+		ba = 0;	/* The real device would crash and never reply */
+	}
+	if (ba && (fs > 0x1000 || fs > bs || !ram_writable(ba, bs))) {	/* Buffer overrun */
+		fprintf(stderr, "lpcsim: data buffer out of RAM (%X, %u, %u)\n", ba, bs, fs);
+		ba = 0;
+	}
+	for (;;) {
+		if ((rc = rcvr_frame(frm, 20, 1)) != 0) return rc;
+		if (CorruptRate && (LD_DWORD(&frm[0]) == 2 || LD_DWORD(&frm[0]) == 5) && ++WriteCount % CorruptRate == 0 && WriteCount / CorruptRate % 2) {
+			frm[10] ^= 0x40;	/* Header corrupted on the line (data length) */
+		}
+		cmd = LD_DWORD(&frm[0]); a1 = LD_DWORD(&frm[4]); a2 = LD_DWORD(&frm[8]); a3 = LD_DWORD(&frm[12]); a4 = LD_DWORD(&frm[16]);
+		n = (cmd == 2) ? a2 : 0;
+		rc = 0;
+		if ((cmd == 2 || cmd == 4 || cmd == 5) && (a2 == 0 || a2 > fs || a4 > bs || a2 > bs - a4)) {	/* Rejected before the data */
+			if (Verbose) fprintf(stderr, "lpcsim: frame header rejected (%u %X %X %u %X)\n", cmd, a1, a2, a3, a4);
+			rc = 2;
+		}
+		if (!rc && cmd == 5 && (rc = rcvr_packed(xb, a2, &frm[20], &n)) < 0) return rc;	/* Packed data */
+		if (!rc && (rc = (cmd == 5) ? rcvr_frame(&frm[20 + n], 4, 0) : rcvr_frame(&frm[20], n + 4, 0)) < 0) return rc;
+		if (rc == 1) return rc;
+		if (!ba) continue;
+		if (!rc && CorruptRate && n && WriteCount % CorruptRate == 0) {
+			frm[20 + n / 2] ^= 0x10;	/* Data corrupted on the line */
+		}
+		if (Verbose) fprintf(stderr, "lpcsim: frame %u %X %X %u %X\n", cmd, a1, a2, a3, a4);
+		val = 0;
+		if (rc || LD_DWORD(&frm[20 + n]) != crc32(frm, 20 + n)) {
+			while (!rx_idle(100)) {	/* Discard the rest of the frame */
+				if (get_byte() < 0) return -1;
+			}
+			st = 0x100;	/* Frame rejected */
+		} else if (cmd == 1) {	/* Prepare and erase sectors */
+			for (s = a1; s <= a2 && (int)s < num_sect(); s++) PrepMap |= 1ULL << s;
+			st = erase_sect(a1, a2);
+		} else if (cmd == 2 || cmd == 4 || cmd == 5) {	/* Prepare a sector and copy the data buffer to flash */
+			if (cmd == 2) memcpy(&Ram[ba + a4 - Target->RamAddr], &frm[20], n);
+			if (cmd == 5) memcpy(&Ram[ba + a4 - Target->RamAddr], xb, a2);
+			if ((int)a3 < num_sect()) PrepMap |= 1ULL << a3;
+			st = copy_flash(a1, ba + a4, a2);
+		} else if (cmd == 3) {	/* CRC of flash memory */
+			st = (a2 && a1 + a2 <= Target->FlashSize) ? CMD_SUCCESS : ADDR_ERROR;
+			if (st == CMD_SUCCESS) val = crc32(&Flash[a1], a2);
+		} else {
+			st = INVALID_COMMAND;
+		}
+		ST_DWORD(&rep[0], st); ST_DWORD(&rep[4], val);
+		put_data(rep, 8);
+	}
+}
+
+
+/* Run the flash read code loaded at the address (G command) */
+static
+int run_code (	/* -1:port closed, 1:reset */
+	uint32_t addr
+)
+{
+	const uint8_t *code;
+	uint32_t ba, bs, sum, n;
+	uint8_t hdr[4];
+	int c;
+
+
+	code = mem_ptr(addr, 92);
+	if (!code) return -1;
+	if (LD_DWORD(&code[4]) == 0x5743504C && mem_ptr(addr, 128)) return run_writer(code);	/* Flash write code ("LPCW") */
+	if (LD_DWORD(&code[48]) == 0xEDB88320) {	/* Streaming read code (block + CRC32) */
+		ba = LD_DWORD(&code[40]); bs = LD_DWORD(&code[44]);
+		if (Verbose) fprintf(stderr, "lpcsim: stream read code started (block %u from %X)\n", bs, ba);
+		for (;;) {
+			do {
+				if ((c = get_byte()) < 0) return -1;
+				if (c == '?' && RxPtr == 1 && RxGap > 0.05) return 1;	/* Reset by the host */
+			} while (c != 0xAA);
+			if (ba + bs > sizeof Flash) ba = 0;
+			sum = crc32(&Flash[ba], bs);
+			put_data(&Flash[ba], bs);
+			hdr[0] = (uint8_t)sum; hdr[1] = (uint8_t)(sum >> 8); hdr[2] = (uint8_t)(sum >> 16); hdr[3] = (uint8_t)(sum >> 24);
+			put_data(hdr, 4);
+			ba += bs;
+		}
+	}
+	bs = LD_DWORD(&code[84]);					/* Block size in the literal pool */
+	ba = (code[7] == 0x4B || code[9] == 0x4B) ? LD_DWORD(&code[88]) : 0;	/* Start address (extended code) */
+	if (Verbose) fprintf(stderr, "lpcsim: read code started (block %u from %X)\n", bs, ba);
+
+	for (;;) {
+		do {
+			if ((c = get_byte()) < 0) return -1;
+			if (c == '?' && RxPtr == 1 && RxGap > 0.05) return 1;	/* Reset by the host */
+		} while (c != 0xAA);
+		if (ba + bs > Target->FlashSize) {	/* The real device would fault here */
+			ba = 0;
+		}
+		for (sum = n = 0; n < bs; n++) sum += Flash[ba + n];
+		put_data(&Flash[ba], bs);
+		hdr[0] = (uint8_t)sum; hdr[1] = (uint8_t)(sum >> 8);
+		put_data(hdr, 2);
+		ba += bs;
+	}
+}
+
+
+/* Process an ISP command (0:succeeded, -1:port closed, 1:reset by the host) */
+static
+int do_command (
+	char* line
+)
+{
+	char buf[128], *cp;
+	uint32_t p[4], s;
+	uint8_t *src, *dst;
+	int np, i, n;
+
+
+	cp = line;
+	while (*cp == '?') cp++;	/* Excess sync requests */
+	for (np = 0, i = 1; np < 4; np++) {	/* Parse parameters */
+		while (cp[i] == ' ') i++;
+		if (!isdigit((uint8_t)cp[i])) break;
+		p[np] = strtoul(&cp[i], &cp, 10) ; i = 0;
+	}
+	if (!np) cp = line;
+	while (*line == '?') line++;
+
+	CmdCount++;
+	wait_us(CmdLatency);
+	if (Verbose) fprintf(stderr, "lpcsim: %s\n", line);
+	if (FaultRate && CmdCount % FaultRate == 0) {
+		put_rc(BUSY);
+		return 0;
+	}
+
+	switch (line[0]) {
+	case 'A' :	/* Echo on/off */
+		if (np != 1 || p[0] > 1) { put_rc(PARAM_ERROR); break; }
+		put_rc(CMD_SUCCESS);
+		Echo = p[0];
+		break;
+
+	case 'U' :	/* Unlock */
+		put_rc(np == 1 && p[0] == 23130 ? CMD_SUCCESS : INVALID_CODE);
+		break;
+
+	case 'B' :	/* Set baud rate */
+		put_rc(np == 2 ? CMD_SUCCESS : PARAM_ERROR);
+		break;
+
+	case 'J' :	/* Read part ID */
+		put_rc(CMD_SUCCESS);
+		sprintf(buf, "%u", Sign);
+		put_line(buf);
+		break;
+
+	case 'K' :	/* Read boot code version */
+		put_rc(CMD_SUCCESS);
+		put_line("7"); put_line("1");
+		break;
+
+	case 'N' :	/* Read device serial number */
+		if (!(Target->Cmds & 2)) { put_rc(INVALID_COMMAND); break; }
+		put_rc(CMD_SUCCESS);
+		for (i = 0; i < 4; i++) {
+			sprintf(buf, "%u", 0x12345678 * (i + 1) ^ Sign);
+			put_line(buf);
+		}
+		break;
+
+	case 'W' :	/* Write to RAM */
+		if (np != 2) { put_rc(PARAM_ERROR); break; }
+		if ((p[0] & 3) || !ram_writable(p[0], p[1])) { put_rc(DST_ADDR_ERROR); break; }
+		if (p[1] & 3) { put_rc(COUNT_ERROR); break; }
+		put_rc(CMD_SUCCESS);
+		if (rcvr_data(&Ram[p[0] - Target->RamAddr], p[1])) return -1;
+		if (CorruptRate && ++WriteCount % CorruptRate == 0 && p[1]) {
+			Ram[p[0] - Target->RamAddr + p[1] / 2] ^= 0x10;	/* Data corrupted after reception */
+		}
+		break;
+
+	case 'R' :	/* Read memory */
+		if (np != 2) { put_rc(PARAM_ERROR); break; }
+		if ((p[0] & 3) || (p[1] & 3)) { put_rc(ADDR_ERROR); break; }
+		src = mem_ptr(p[0], p[1]);
+		if (!src) { put_rc(ADDR_NOT_MAPPED); break; }
+		put_rc(CMD_SUCCESS);
+		if (Target->RawMode) {
+			put_data(src, p[1]);
+		} else {
+			for (s = 0, n = 0; n < (int)p[1]; ) {
+				i = (p[1] - n > 45) ? 45 : p[1] - n;
+				uuencode(&src[n], i, buf);
+				put_line(buf);
+				while (i--) s += src[n++];
+				if (n % 900 == 0 || n == (int)p[1]) {
+					sprintf(buf, "%u", s);
+					put_line(buf);
+					if (get_line(buf, sizeof buf) < 0) return -1;
+					s = 0;
+				}
+			}
+		}
+		break;
+
+	case 'P' :	/* Prepare sectors */
+		if (np != 2 || p[1] < p[0] || (int)p[1] >= num_sect()) { put_rc(INVALID_SECTOR); break; }
+		for (s = p[0]; s <= p[1]; s++) PrepMap |= 1ULL << s;
+		put_rc(CMD_SUCCESS);
+		break;
+
+	case 'E' :	/* Erase sectors */
+		if (np != 2 || p[1] < p[0] || (int)p[1] >= num_sect()) { put_rc(INVALID_SECTOR); break; }
+		put_rc(erase_sect(p[0], p[1]));
+		break;
+
+	case 'I' :	/* Blank check sectors */
+		if (np != 2 || p[1] < p[0] || (int)p[1] >= num_sect()) { put_rc(INVALID_SECTOR); break; }
+		for (s = Target->SectMap[p[0]]; s < Target->SectMap[p[1] + 1] && LD_DWORD(&Flash[s]) == 0xFFFFFFFF; s += 4) ;
+		if (s < Target->SectMap[p[1] + 1]) {
+			put_rc(SECTOR_NOT_BLANK);
+			sprintf(buf, "%u", s); put_line(buf);
+			sprintf(buf, "%u", LD_DWORD(&Flash[s])); put_line(buf);
+		} else {
+			put_rc(CMD_SUCCESS);
+		}
+		break;
+
+	case 'C' :	/* Copy RAM to flash */
+		if (np != 3) { put_rc(PARAM_ERROR); break; }
+		put_rc(copy_flash(p[0], p[1], p[2]));
+		break;
+
+	case 'M' :	/* Compare */
+		if (np != 3) { put_rc(PARAM_ERROR); break; }
+		src = mem_ptr(p[0], p[2]); dst = mem_ptr(p[1], p[2]);
+		if (!src || !dst || (p[2] & 3)) { put_rc(ADDR_ERROR); break; }
+		for (s = 0; s < p[2] && src[s] == dst[s]; s++) ;
+		if (s < p[2]) {
+			put_rc(COMPARE_ERROR);
+			sprintf(buf, "%u", s & ~3); put_line(buf);
+		} else {
+			put_rc(CMD_SUCCESS);
+		}
+		break;
+
+	case 'S' :	/* Read CRC checksum */
+		if (!(Target->Cmds & 1)) { put_rc(INVALID_COMMAND); break; }
+		if (np != 2) { put_rc(PARAM_ERROR); break; }
+		if ((p[0] & 3) || (p[1] & 3)) { put_rc(ADDR_ERROR); break; }
+		src = mem_ptr(p[0], p[1]);
+		if (!src) { put_rc(ADDR_NOT_MAPPED); break; }
+		put_rc(CMD_SUCCESS);
+		sprintf(buf, "%u", crc32(src, p[1]));
+		put_line(buf);
+		break;
+
+	case 'G' :	/* Go */
+		if (np != 1 || !mem_ptr(p[0], 4) || p[0] < Target->RamAddr) { put_rc(ADDR_ERROR); break; }
+		put_rc(CMD_SUCCESS);
+		return run_code(p[0]);
+
+	default :
+		put_rc(INVALID_COMMAND);
+	}
+	return 0;
+}
+
+
+/* Serve a session from reset until the host closes the port or resets the device */
+static
+int serve (	/* 0:port closed, 1:reset */
+	int reset	/* The device has been reset in the idle time (boot loader is ready) */
+)
+{
+	char line[256];
+	int c, drop = SyncDrop;
+	double t = reset ? 0 : get_time() + BootTime / 1000.0;
+
+
+	Echo = 1; PrepMap = 0; CmdCount = 0;
+
+	/* Auto-baud: wait for a '?' (ignored while booting) */
+	for (;;) {
+		do {
+			if ((c = get_byte()) < 0) return 0;
+		} while (c != '?' || get_time() < t);
+		if (drop > 0) {
+			drop--;
+			continue;
+		}
+		put_line("Synchronized");
+		if (get_line(line, sizeof line) < 0) return 0;
+		if (!strcmp(line, "Synchronized")) break;
+	}
+	put_line(line);	/* Echo */
+	put_line("OK");
+	if (get_line(line, sizeof line) < 0) return 0;	/* Crystal frequency */
+	put_line(line);
+	put_line("OK");
+
+	for (;;) {
+		/* A pty cannot convey the DTR reset: '?' after an idle time is taken as a new session */
+		if ((c = get_byte()) < 0) return 0;
+		RxPtr--;
+		if (c == '?' && RxPtr == 0 && RxGap > 0.05) return 1;
+		if (get_line(line, sizeof line) < 0) return 0;
+		if (Echo) put_line(line);
+		if ((c = do_command(line)) != 0) {
+			RxPtr -= (c > 0);	/* Leave the '?' to the auto-baud */
+			return c > 0;
+		}
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------
+  Main
+-----------------------------------------------------------------------*/
+
+static
+int open_pty (void)
+{
+	struct termios tio;
+	char *name;
+	int fd;
+
+
+	Pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if (Pty < 0 || grantpt(Pty) || unlockpt(Pty) || !(name = ptsname(Pty))) {
+		perror("lpcsim: pty");
+		return 1;
+	}
+	fd = open(name, O_RDWR | O_NOCTTY);	/* Put the line in raw mode */
+	if (fd >= 0) {
+		tcgetattr(fd, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+		close(fd);
+	}
+	fcntl(Pty, F_SETFL, fcntl(Pty, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+
+/* Save flash memory contents */
+static
+void dump_flash (void)
+{
+	FILE *fp;
+
+	fp = fopen(DumpFile, "wb");
+	if (fp) {
+		fwrite(Flash, 1, Target->FlashSize, fp);
+		fclose(fp);
+	}
+}
+
+
+/* Wait for the host to open the port */
+static
+void wait_open (void)
+{
+	struct pollfd pfd;
+
+	for (;;) {
+		pfd.fd = Pty; pfd.events = POLLIN;
+		if (poll(&pfd, 1, 10) >= 0 && !(pfd.revents & POLLHUP)) return;
+		wait_us(2000);
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------
+  Benchmark (runs LPCSP against the simulated devices)
+-----------------------------------------------------------------------*/
+
+uint32_t ImgSize = 0x10000;	/* -z<size> Maximum image size of the benchmark */
+uint32_t Rand = 1;			/* Pseudo random number generator */
+
+
+static
+uint32_t rnd (void)
+{
+	Rand = Rand * 1103515245 + 12345;
+	return Rand >> 16;
+}
+
+
+/* Create a test image like a firmware (code, zero filled data, repeated table and blank area) */
+static
+void make_image (
+	uint8_t* img,
+	uint32_t size,			/* Size of the image (rest of the flash memory is blank) */
+	int code				/* 0:random code, 1:code made of recurring byte sequences */
+)
+{
+	uint32_t i, j, n;
+
+
+	memset(img, 0xFF, Target->FlashSize);
+	for (i = 0; i < size / 2; ) {
+		if (!code || i < 256 || rnd() % 4 == 0) {
+			img[i++] = (uint8_t)rnd();
+		} else {	/* Sequence of 4-19 bytes found in the first 256 bytes */
+			for (n = rnd() % 16 + 4, j = rnd() % 236; n && i < size / 2; n--) img[i++] = img[j++];
+		}
+	}
+	for ( ; i < size * 3 / 4; i++) img[i] = 0;
+	for ( ; i < size; i++) img[i] = img[i % 256];
+}
+
+
+/* Write an image in Intel HEX format */
+static
+int write_hex (
+	const char* fname,
+	const uint8_t* img,
+	uint32_t size
+)
+{
+	FILE *fp;
+	uint32_t a, n, sum;
+
+
+	fp = fopen(fname, "w");
+	if (!fp) return 1;
+	for (a = 0; a < size; a += 32) {
+		if (a % 0x10000 == 0) fprintf(fp, ":02000004%04X%02X\n", a >> 16, (0x100 - (6 + (a >> 24) + (a >> 16 & 0xFF))) & 0xFF);
+		sum = 32 + (a >> 8 & 0xFF) + (a & 0xFF);
+		fprintf(fp, ":20%04X00", a & 0xFFFF);
+		for (n = 0; n < 32; n++) {
+			fprintf(fp, "%02X", img[a + n]);
+			sum += img[a + n];
+		}
+		fprintf(fp, "%02X\n", (0x100 - (sum & 0xFF)) & 0xFF);
+	}
+	fprintf(fp, ":00000001FF\n");
+	return fclose(fp) ? 1 : 0;
+}
+
+
+/* Load an Intel HEX file into the buffer */
+static
+int load_hex (
+	const char* fname,
+	uint8_t* buf,
+	uint32_t size
+)
+{
+	FILE *fp;
+	char line[600];
+	uint8_t rec[260];
+	uint32_t base = 0, a, n, i, v;
+
+
+	fp = fopen(fname, "r");
+	if (!fp) return 1;
+	memset(buf, 0xFF, size);
+	while (fgets(line, sizeof line, fp)) {
+		if (line[0] != ':') continue;
+		for (n = 0; n < sizeof rec && sscanf(&line[1 + n * 2], "%2x", &v) == 1; n++) rec[n] = (uint8_t)v;
+		if (n < 5 || n < rec[0] + 5u) break;
+		a = base + (rec[1] << 8 | rec[2]);
+		switch (rec[3]) {
+		case 0 :	/* Data */
+			for (i = 0; i < rec[0] && a + i < size; i++) buf[a + i] = rec[4 + i];
+			break;
+		case 2 :	/* Extended segment address */
+			base = (rec[4] << 8 | rec[5]) << 4;
+			break;
+		case 4 :	/* Extended linear address */
+			base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+			break;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+
+/* Run LPCSP and return its exit code (-1:failed to run) */
+static
+int run_lpcsp (
+	char* const args[],		/* Command line */
+	const char* out			/* Output file of stdout (NULL:discarded) */
+)
+{
+	pid_t pid;
+	int st, fd;
+
+
+	pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		fd = open(out ? out : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) dup2(fd, 1);
+		if (!Verbose && (fd = open("/dev/null", O_WRONLY)) >= 0) dup2(fd, 2);
+		execvp(args[0], args);
+		_exit(127);
+	}
+	if (waitpid(pid, &st, 0) < 0 || !WIFEXITED(st)) return -1;
+	return WEXITSTATUS(st);
+}
+
+
+/* Wait for end of the session on the simulated device */
+static
+int wait_session (
+	int fd
+)
+{
+	struct pollfd pfd;
+	char c;
+
+
+	pfd.fd = fd; pfd.events = POLLIN;
+	return (poll(&pfd, 1, 5000) == 1 && read(fd, &c, 1) == 1) ? 0 : 1;
+}
+
+
+/* Benchmark write, verify and read of each device family */
+static
+int bench (
+	const char* prog		/* LPCSP executable */
+)
+{
+	char dir[] = "/tmp/lpcsimXXXXXX", hex[64], dump[64], rd[64], port[300];
+	char *args[6];
+	static uint8_t img[sizeof Flash], buf[sizeof Flash];
+	uint32_t size, i, s;
+	double t[3];
+	int np[2], ng = 0, rc, c, code;
+	const char *res;
+	FILE *fp;
+	pid_t pid;
+
+
+	if (!mkdtemp(dir)) {
+		perror("lpcsim: bench");
+		return 1;
+	}
+	sprintf(hex, "%s/image.hex", dir);
+	sprintf(dump, "%s/flash.bin", dir);
+	sprintf(rd, "%s/read.hex", dir);
+	DumpFile = dump;
+
+	/* Check the data processing functions of LPCSP and show their throughput */
+	args[0] = (char*)prog; args[1] = "--test"; args[2] = NULL;
+	rc = run_lpcsp(args, rd);
+	if (rc) ng++;
+	fp = fopen(rd, "r");
+	if (fp) {
+		while ((c = getc(fp)) != EOF) putchar(c);
+		fclose(fp);
+	}
+	if (rc) printf("Self test failed (%d).\n", rc);
+	printf("\n");
+
+	printf("Device     Image  Write[s]  Verify[s]  Read[s]  Write[B/s]  Result\n");
+	for (Target = TgtLst, code = 0; Target->DeviceName; Target++) {
+		Sign = Target->Sign;
+		size = Target->FlashSize / 4;
+		if (size > ImgSize) size = ImgSize;
+		size &= ~3;
+		make_image(img, size, code);
+		if (write_hex(hex, img, size) || open_pty() || pipe(np)) {
+			perror("lpcsim: bench");
+			return 1;
+		}
+		snprintf(port, sizeof port, "-p%s:115200", ptsname(Pty));
+
+		memset(Flash, 0xFF, sizeof Flash);
+		pid = fork();
+		if (pid == 0) {	/* Simulated device */
+			close(np[0]);
+			for (;;) {
+				wait_open();
+				RxPtr = RxCnt = 0;
+				for (c = serve(0); c; c = serve(1)) ;
+				dump_flash();
+				if (write(np[1], "", 1) < 0) _exit(1);
+			}
+		}
+		close(np[1]);
+
+		res = "OK";
+		/* Write the image and check the flash memory contents (vector check sum is patched by LPCSP) */
+		args[0] = (char*)prog; args[1] = port; args[2] = hex; args[3] = NULL;
+		t[0] = get_time();
+		rc = run_lpcsp(args, NULL);
+		t[0] = get_time() - t[0];
+		if (rc || wait_session(np[0])) {
+			res = "NG(write)";
+		} else {
+			fp = fopen(dump, "rb");
+			if (!fp || fread(buf, 1, Target->FlashSize, fp) != Target->FlashSize) res = "NG(dump)";
+			if (fp) fclose(fp);
+			for (i = s = 0; i < 32; i += 4) s += LD_DWORD(&buf[i]);
+			if (s) res = "NG(sum)";
+			for (i = 0; i < Target->FlashSize && (buf[i] == img[i] || (i >= Target->Sum && i < Target->Sum + 4)); i++) ;
+			if (i < Target->FlashSize) res = "NG(data)";
+			memcpy(img, buf, Target->FlashSize);	/* Expected data of read back */
+		}
+
+		/* Verify the flash memory without programming */
+		args[1] = port; args[2] = "-v1"; args[3] = hex; args[4] = NULL;
+		t[1] = get_time();
+		rc = run_lpcsp(args, NULL);
+		t[1] = get_time() - t[1];
+		if (wait_session(np[0]) || (rc && !strcmp(res, "OK"))) res = "NG(verify)";
+
+		/* Read back the flash memory */
+		args[1] = port; args[2] = "-r"; args[3] = NULL;
+		t[2] = get_time();
+		rc = run_lpcsp(args, rd);
+		t[2] = get_time() - t[2];
+		if (wait_session(np[0]) || ((rc || load_hex(rd, buf, Target->FlashSize) || memcmp(buf, img, Target->FlashSize)) && !strcmp(res, "OK"))) {
+			res = "NG(read)";
+		}
+
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		close(np[0]);
+		close(Pty);
+		if (strcmp(res, "OK")) ng++;
+		printf("LPC%-5s%c %6u %9.2f %10.2f %8.2f %11.0f  %s\n", Target->DeviceName, code ? '*' : ' ', size, t[0], t[1], t[2], size / t[0], res);
+		fflush(stdout);
+		if (code) break;
+		if (!Target[1].DeviceName) {	/* Once more on LPC1768 with the code packed well like a real firmware */
+			for (Target = TgtLst; strcmp(Target->DeviceName, "1768"); Target++) ;
+			Target--; code = 1;
+		}
+	}
+	printf("* Code part of the image is made of recurring byte sequences\n");
+
+	unlink(hex); unlink(dump); unlink(rd); rmdir(dir);
+	return ng ? 1 : 0;
+}
+
+
+int main (int argc, char** argv)
+{
+	const char *dev = "1768", *prog = NULL;
+	int once = 0, i;
+	long baud = 0;
+	char *cp;
+
+
+	Sign = 0;
+	for (i = 1; i < argc; i++) {
+		cp = argv[i];
+		if (*cp++ != '-') break;
+		switch (*cp++) {
+		case 't' : dev = cp; break;								/* -t<device> */
+		case 'j' : Sign = strtoul(cp, NULL, 0); break;			/* -j<signature> */
+		case 'b' : baud = strtol(cp, NULL, 10); break;			/* -b<bps> */
+		case 'l' : CmdLatency = strtol(cp, NULL, 10); break;	/* -l<us> */
+		case 'u' : UsbLatency = strtol(cp, NULL, 10); break;	/* -u<us> */
+		case 'e' : FaultRate = strtol(cp, NULL, 10); break;		/* -e<n> */
+		case 's' : SyncDrop = strtol(cp, NULL, 10); break;		/* -s<n> */
+		case 'w' : BootTime = strtol(cp, NULL, 10); break;		/* -w<ms> */
+		case 'c' : CorruptRate = strtol(cp, NULL, 10); break;	/* -c<n> */
+		case 'z' : ImgSize = strtoul(cp, NULL, 0); break;		/* -z<size> */
+		case 'B' : prog = cp; break;							/* -B<lpcsp> */
+		case 'o' : DumpFile = cp; break;						/* -o<file> */
+		case '1' : once = 1; break;								/* -1 */
+		case 'v' : Verbose = 1; break;							/* -v */
+		default :
+			fprintf(stderr, "usage: lpcsim [-t<device>] [-j<sign>] [-b<bps>] [-l<us>] [-u<us>] [-e<n>] [-s<n>] [-w<ms>] [-c<n>] [-o<file>] [-1] [-v]\n"
+							"       lpcsim -B<lpcsp> [-z<size>] [-b<bps>] [-l<us>] [-u<us>] [-v]\n");
+			return 1;
+		}
+	}
+	if (baud) ByteTime = 10000000L / baud;
+	signal(SIGPIPE, SIG_IGN);
+	if (prog) return bench(prog);
+
+	for (Target = TgtLst; Target->DeviceName && strcmp(Target->DeviceName, dev); Target++) ;
+	if (!Target->DeviceName) {
+		fprintf(stderr, "lpcsim: unknown device LPC%s\n", dev);
+		return 1;
+	}
+	if (!Sign) Sign = Target->Sign;
+	memset(Flash, 0xFF, sizeof Flash);
+
+	if (open_pty()) return 1;
+	printf("%s\n", ptsname(Pty));
+	fflush(stdout);
+
+	do {
+		wait_open();
+		RxPtr = RxCnt = 0;
+		for (i = serve(0); i; i = serve(1)) {	/* Reset by the host */
+			if (DumpFile) dump_flash();
+		}
+		if (DumpFile) dump_flash();
+	} while (!once);
+
+	return 0;
+}
@@ -50,13 +50,52 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define USE_X86_SIMD	/* x86 SIMD paths are available (selected at run time) */
+#endif
 
 
 #define INIFILE "lpcsp.ini"
+#define SYNCFILE "lpcsp.syn"	/* Sync parameters learned on each port */
+#define UIDFILE "lpcsp.uid"		/* Sector CRCs programmed into each device (by serial number) */
 #define MESS(str) fputs(str, stderr)
 #define LD_DWORD(ptr) (uint32_t)(((uint32_t)*((uint8_t*)(ptr)+3)<<24)|((uint32_t)*((uint8_t*)(ptr)+2)<<16)|((uint16_t)*((uint8_t*)(ptr)+1)<<8)|*(uint8_t*)(ptr))
 #define ST_DWORD(ptr,val) *(uint8_t*)(ptr)=(uint8_t)(val); *((uint8_t*)(ptr)+1)=(uint8_t)((uint16_t)(val)>>8); *((uint8_t*)(ptr)+2)=(uint8_t)((uint32_t)(val)>>16); *((uint8_t*)(ptr)+3)=(uint8_t)((uint32_t)(val)>>24)
 #define	SZ_CODE 88
+#define MAX_PORT 32		/* Maximum number of ports driven in gang mode */
+#define SECT_BIT(n) ((uint64_t)1 << (n))	/* Sector bit in sector map (up to 64 sectors) */
+#define HAS_CRC(dev) ((dev)->RawMode)		/* Read CRC command (S) is available on the devices with raw mode transfer */
+#define MAX_COPY(dev) (((dev)->Code == Code800) ? 1024 : 4096)	/* Maximum byte count of copy command */
+#define USE_STUB(ses) ((ses)->FrameSize && !IspOnly && !(Verify && (VerifyOpt & 2)))	/* Flash write code is used (not when mismatched sectors are read back) */
+#define MIN_COPY(dev) (((dev)->Code == Code800) ? 64 : 256)		/* Minimum byte count of copy command */
+#define IMG_PAGE 1024	/* Page size of the data image (sector sizes are multiple of this) */
+#define IMG_CACHE 8		/* Number of images cached in daemon mode */
+#define MAX_IMAGE 0x1000000	/* Address space of the data image (16M) */
+#define RAM_RSV 0x120	/* RAM area at top of RAM used by the boot loader (IAP work and stack) */
+#define RX_FIFO 16		/* Size of UART receive FIFO in the device */
+#define MAX_QUEUE 8		/* Maximum number of commands in the command queue */
+#define SZ_READ 156		/* Size of streaming flash read code */
+#define READ_BLOCK 4096	/* Maximum block size of streaming flash read */
+#define READ_DEPTH 4	/* Number of block requests in flight on flash read (must be less than RX_FIFO) */
+#define SZ_WRITE 660	/* Size of flash write code */
+#define WRITE_AREA 768	/* RAM area for the flash write code (its data buffer follows) */
+#define WRITE_RETRY 3	/* Number of retries of a frame rejected by the flash write code */
+#define RTT_CMDS "?AJUWRGIPECSMNB"	/* Commands of which round trip time is measured */
+#define SYNC_TIME 2.4		/* Time to try sync after a reset [sec] */
+#define RTT_BINS 16		/* Number of bins of round trip time histogram (bin n: up to 0.1ms * 2^n) */
+#define STREAM_CHUNK 0x10000	/* Read size of the input stream */
+#define STREAM_WINDOW 0x40000	/* Maximum amount of the streamed image held ahead of the slowest target */
 
 
 typedef struct {
@@ -73,14 +112,97 @@ typedef struct {
 } DEVICE;
 
 
+typedef enum {		/* Processing phases of a session */
+	PH_SYNC,		/* Entering ISP mode */
+	PH_PROBE,		/* Probing RAM size */
+	PH_DIFF,		/* Comparing sectors (-d) */
+	PH_ERASE,		/* Erasing sectors */
+	PH_WRITE,		/* Writing data */
+	PH_VERIFY,		/* Verifying sectors (-v) */
+	PH_READ,		/* Reading flash memory (-r) */
+	PH_EXIT,		/* Leaving ISP mode */
+	N_PHASE
+} phase_t;
+
+
+typedef struct {
+	uint32_t Count;				/* Number of commands */
+	double Sum, Min, Max;		/* Total, minimum and maximum round trip time [sec] */
+	uint32_t Hist[RTT_BINS];	/* Histogram of round trip time */
+} RTTSTAT;
+
+
+typedef struct {
+	const char* Port;			/* Port name */
+	int Com;					/* Port handle */
+	int ComLost;				/* The port has been hung up or failed (it is reopened by the next job in daemon mode) */
+	const DEVICE* Device;		/* Detected device property */
+	const char* Del;			/* Delimiter character of ISP command */
+	struct termios Tio, OldTio;	/* Port settings (current/saved) */
+	struct timeval Timeout;		/* Processing timeout */
+	uint8_t Vect[32];			/* Vector table with valid check sum */
+	uint64_t Erase, Write;		/* Sectors to be erased/written */
+	uint32_t BuffSize;			/* Size of data write buffer in the device RAM */
+	uint32_t CopySize;			/* Data size of a copy command */
+	uint32_t FrameSize;			/* Data size of a write frame of the flash write code (0:not available) */
+	int StubRun;				/* The flash write code is running (ISP commands are no longer available) */
+	uint32_t Resend;			/* Number of frames resent to the flash write code */
+	uint32_t DataEnd;			/* Highest address of the data to be processed */
+	uint32_t StreamPos;			/* The streamed image below this address is no longer needed (0xFFFFFFFF:finished) */
+	uint8_t Blk[0x10000];		/* Data to be sent or compared (up to BuffSize or a sector) */
+	char Tx[2048];				/* Transmit queue */
+	uint32_t TxLen;				/* Length of data in the transmit queue */
+	uint8_t Rx[4096];			/* Receive buffer */
+	uint32_t RxPtr, RxCnt;		/* Read pointer and data count in the receive buffer */
+	char Que[256];				/* Command queue (commands not sent yet) */
+	uint32_t QueLen;			/* Length of commands in the queue */
+	char QueCmd[MAX_QUEUE];		/* Command character of each command in the queue */
+	int QueNum;					/* Number of commands in the queue */
+	int QueTail;				/* Length of commands queued after a long-running command (-1:no long-running command) */
+	char Res[80];				/* Response of the failed command */
+	uint32_t Cmds;				/* Number of commands issued via command queue */
+	double CmdTime;				/* Time spent to issue the commands [sec] */
+	double PhTime[N_PHASE];		/* Time spent in each phase [sec] */
+	uint32_t PhWire[N_PHASE];	/* Bytes sent and received in each phase */
+	uint32_t PhData[N_PHASE];	/* Bytes of flash memory processed in each phase */
+	double PhStart;				/* Start time of current phase */
+	uint32_t WireCnt, DataCnt;	/* Bytes sent and received / bytes of flash memory processed */
+	uint32_t PhWire0, PhData0;	/* Counters at start of current phase */
+	char RttCmd;				/* Command waiting for its first response line (0:none) */
+	double RttStart;			/* Time when the command was sent */
+	RTTSTAT Rtt[sizeof RTT_CMDS - 1];	/* Round trip time of each command */
+	uint32_t SyncSign;			/* Device signature the sync parameters learned with (0:not learned) */
+	uint32_t SyncWait;			/* Boot time of the device after reset [ms] */
+	int SyncCr;					/* Line ending accepted by the device (0:LF, 1:CR+LF) */
+	uint32_t SyncTry;			/* Number of sync requests sent */
+	uint32_t Uid[4];			/* Device serial number */
+	int HasUid;					/* Device serial number is available */
+	int UidUpdate;				/* The UID cache entry is to be updated (flash memory has been modified or verified) */
+	uint32_t SectCrc[64];		/* CRC32 of each sector programmed */
+	uint64_t CrcValid;			/* Sectors with valid SectCrc */
+	int Rc;						/* Result code */
+	double Time;				/* Processing time [sec] */
+	char Msg[80];				/* Last message (gang mode) */
+} SESSION;
+
+
 const char *Usage =
 	"LPCSP - LPC8xx/1xxx/2xxx/4xxx Serial Programming tool R0.05 (C)ChaN,2018\n"
 	"\n"
-	"Write flash memory:    <hex file> [<hex file>] ...\n"
-	"Read flash memory:     -R\n"
-	"Port number and speed: -P<n>[:<bps>]\n"
+	"Write flash memory:    <file> [<file>] ...\n"
+	"                       (hex, S-record, ELF or <bin file>@<address>)\n"
+	"                       (- or a named pipe is streamed)\n"
+	"Read flash memory:     -R[<start>-<end>]\n"
+	"Port name and speed:   -P<name>[,<name>...][:<bps>]\n"
 	"Oscillator frequency:  -F<n> (used for only LPC21xx/22xx)\n"
 	"Do not block CRP3:     -3\n"
+	"Update changed sectors:-D\n"
+	"Erase entire flash:    -E\n"
+	"ISP commands only:     -I\n"
+	"Verify flash memory:   -V[<flag>] (see lpcsp.ini)\n"
+	"Timing statistics:     --stats[=<JSON file>]\n"
+	"Daemon mode:           --serve=<socket> (see lpcsp.ini)\n"
+	"Self test:             --test\n"
 	"Signal polarity:       -C<flag> (see lpcsp.ini)\n"
 	"Wait on exit:          -W<mode> (see lpcsp.ini)\n"
 	"\n"
@@ -109,7 +231,7 @@ const uint32_t Map2[] = { 0x0000, 0x2000, 0x4000, 0x6000, 0x8000, 0xA000, 0xC000
 const uint32_t Map3[] = { 0x0000, 0x2000, 0x4000, 0x6000, 0x8000, 0xA000, 0xC000, 0xE000, 0x10000, 0x20000, 0x30000, 0x32000, 0x34000, 0x36000, 0x38000, 0x3A000, 0x3C000, 0x3E000, 0x40000 };
 const uint32_t Map4[] = { 0x0000, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x9000, 0xA000, 0xB000, 0xC000, 0xD000, 0xE000, 0xF000, 0x10000, 0x18000, 0x20000, 0x28000, 0x30000, 0x38000, 0x40000, 0x48000, 0x50000, 0x58000, 0x60000, 0x68000, 0x70000, 0x78000, 0x80000 };
 const uint32_t Map5[] = { 0x0000, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x9000, 0xA000, 0xB000, 0xC000, 0xD000, 0xE000, 0xF000, 0x10000, 0x11000, 0x12000, 0x13000, 0x14000, 0x15000, 0x16000, 0x17000, 0x18000, 0x19000, 0x1A000, 0x1B000, 0x1C000, 0x1D000, 0x1E000, 0x1F000, 0x20000, 0x21000, 0x22000, 0x23000, 0x24000, 0x25000, 0x26000, 0x27000, 0x28000, 0x29000, 0x2A000, 0x2B000, 0x2C000, 0x2D000, 0x2E000, 0x2F000, 0x30000, 0x31000, 0x32000, 0x33000, 0x34000, 0x35000, 0x36000, 0x37000, 0x38000, 0x39000, 0x3A000, 0x3B000, 0x3C000, 0x3D000, 0x3E000, 0x3F000, 0x40000 };
-const uint32_t Map6[] = { 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00, 0x2000, 0x2400, 0x2800, 0x2C00, 0x3000, 0x3400, 0x3800, 0x3C00, 0x4000, 0x4400, 0x4800, 0x4C00, 0x5000, 0x5400, 0x5800, 0x5C00, 0x6000, 0x6400, 0x6800, 0x6C00, 0x7000, 0x7400, 0x7800, 0x7C00, 0x8000 };
+const uint32_t Map6[] = { 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00, 0x2000, 0x2400, 0x2800, 0x2C00, 0x3000, 0x3400, 0x3800, 0x3C00, 0x4000, 0x4400, 0x4800, 0x4C00, 0x5000, 0x5400, 0x5800, 0x5C00, 0x6000, 0x6400, 0x6800, 0x6C00, 0x7000, 0x7400, 0x7800, 0x7C00, 0x8000, 0x8400, 0x8800, 0x8C00, 0x9000, 0x9400, 0x9800, 0x9C00, 0xA000, 0xA400, 0xA800, 0xAC00, 0xB000, 0xB400, 0xB800, 0xBC00, 0xC000, 0xC400, 0xC800, 0xCC00, 0xD000, 0xD400, 0xD800, 0xDC00, 0xE000, 0xE400, 0xE800, 0xEC00, 0xF000, 0xF400, 0xF800, 0xFC00, 0x10000 };
 
 /* Flash read code with remap disabled */
 const uint8_t Code2000[SZ_CODE] = {
@@ -153,6 +275,70 @@ const uint8_t Code1500[SZ_CODE] = {
 	0x00, 0x00, 0x04, 0x40, 0x00, 0x04, 0x00, 0x00
 };
 
+/* Streaming flash read code (device dependent parameters at offset 4-47 are filled by host) */
+/* It sends a block of the block size followed by its CRC32 on each 0xAA received */
+const uint8_t CodeRead[SZ_READ] = {
+	0x18, 0xe0, 0xc0, 0x46, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x20, 0x83, 0xb8, 0xed, 0x7f, 0x46, 0x38, 0x3f, 0x78, 0x68, 0xb9, 0x68, 0x01, 0x60, 0xfd, 0x68,
+	0xbb, 0x6a, 0x38, 0x69, 0x79, 0x69, 0x2a, 0x58, 0x0a, 0x42, 0xfc, 0xd0, 0xb8, 0x69, 0x2a, 0x58,
+	0xff, 0x20, 0x02, 0x40, 0xaa, 0x2a, 0xf4, 0xd1, 0xfa, 0x6a, 0x00, 0x24, 0xe4, 0x43, 0x18, 0x78,
+	0x01, 0x33, 0x44, 0x40, 0x08, 0x26, 0x64, 0x08, 0x01, 0xd3, 0x39, 0x6b, 0x4c, 0x40, 0x01, 0x3e,
+	0xf9, 0xd1, 0x00, 0xf0, 0x0b, 0xf8, 0x01, 0x3a, 0xf1, 0xd1, 0xe4, 0x43, 0x04, 0x22, 0x20, 0x00,
+	0x00, 0xf0, 0x04, 0xf8, 0x24, 0x0a, 0x01, 0x3a, 0xf9, 0xd1, 0xda, 0xe7, 0xf9, 0x69, 0x69, 0x58,
+	0x3e, 0x6a, 0x31, 0x42, 0xfa, 0xd0, 0x79, 0x6a, 0x68, 0x50, 0x70, 0x47
+};
+
+/* Flash write code (device dependent parameters at offset 12-59 are filled by host) */
+/* It receives binary frames {command, arg1, arg2, arg3, arg4, [data], CRC32}, calls IAP and replies {status, value} */
+/* A frame with broken header, CRC error or gap in the data is discarded until the line is idle and replied 0x100 */
+/* Command 5 expands the packed data (see pack_block) into the buffer on the fly as it is received */
+const uint8_t CodeWrite[SZ_WRITE] = {
+	0x3e, 0xe0, 0xc0, 0x46, 0x4c, 0x50, 0x43, 0x57, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x64, 0x10, 0xb7, 0x1d, 0xc8, 0x20, 0x6e, 0x3b, 0xac, 0x30, 0xd9, 0x26,
+	0x90, 0x41, 0xdc, 0x76, 0xf4, 0x51, 0x6b, 0x6b, 0x58, 0x61, 0xb2, 0x4d, 0x3c, 0x71, 0x05, 0x50,
+	0x20, 0x83, 0xb8, 0xed, 0x44, 0x93, 0x0f, 0xf0, 0xe8, 0xa3, 0xd6, 0xd6, 0x8c, 0xb3, 0x61, 0xcb,
+	0xb0, 0xc2, 0x64, 0x9b, 0xd4, 0xd2, 0xd3, 0x86, 0x78, 0xe2, 0x0a, 0xa0, 0x1c, 0xf2, 0xbd, 0xbd,
+	0x7f, 0x46, 0x84, 0x3f, 0xfd, 0x68, 0x8e, 0xb0, 0x00, 0x24, 0xe4, 0x43, 0x6b, 0x46, 0x14, 0x22,
+	0x00, 0xf0, 0xbc, 0xf8, 0x00, 0x28, 0x02, 0xd0, 0x14, 0x2a, 0xf5, 0xd0, 0x66, 0xe0, 0x00, 0x98,
+	0x02, 0x28, 0x03, 0xd0, 0x05, 0x28, 0x01, 0xd0, 0x04, 0x28, 0x16, 0xd1, 0x02, 0x9a, 0x00, 0x2a,
+	0x5c, 0xd0, 0xb9, 0x6b, 0x8a, 0x42, 0x59, 0xd8, 0x04, 0x99, 0x7b, 0x6b, 0x99, 0x42, 0x55, 0xd8,
+	0x5b, 0x1a, 0x9a, 0x42, 0x52, 0xd8, 0x3b, 0x6b, 0x5b, 0x18, 0x05, 0x28, 0x1e, 0xd0, 0x02, 0x28,
+	0x03, 0xd1, 0x00, 0xf0, 0x9b, 0xf8, 0x00, 0x28, 0x48, 0xd1, 0xe4, 0x43, 0x05, 0x94, 0x06, 0xab,
+	0x04, 0x22, 0x00, 0xf0, 0x93, 0xf8, 0x00, 0x28, 0x40, 0xd1, 0x06, 0x98, 0x05, 0x99, 0x88, 0x42,
+	0x3c, 0xd1, 0x00, 0x98, 0x01, 0x28, 0x40, 0xd0, 0x02, 0x28, 0x4c, 0xd0, 0x04, 0x28, 0x4a, 0xd0,
+	0x05, 0x28, 0x48, 0xd0, 0x03, 0x28, 0x56, 0xd0, 0x01, 0x20, 0x63, 0xe0, 0x99, 0x46, 0x00, 0xf0,
+	0x8b, 0xf8, 0x80, 0x28, 0x0d, 0xd2, 0x01, 0x30, 0x90, 0x42, 0x27, 0xd8, 0x12, 0x1a, 0x80, 0x46,
+	0x00, 0xf0, 0x82, 0xf8, 0x18, 0x70, 0x01, 0x33, 0x40, 0x46, 0x01, 0x38, 0x80, 0x46, 0xf7, 0xd1,
+	0x19, 0xe0, 0x7d, 0x38, 0x90, 0x42, 0x19, 0xd8, 0x12, 0x1a, 0x80, 0x46, 0x00, 0xf0, 0x74, 0xf8,
+	0x07, 0x90, 0x00, 0xf0, 0x71, 0xf8, 0x00, 0x02, 0x07, 0x99, 0x08, 0x43, 0x0e, 0xd0, 0x4e, 0x46,
+	0x9e, 0x1b, 0xb0, 0x42, 0x0a, 0xd8, 0x19, 0x1a, 0x40, 0x46, 0x0e, 0x78, 0x1e, 0x70, 0x01, 0x31,
+	0x01, 0x33, 0x01, 0x38, 0xf9, 0xd1, 0x00, 0x2a, 0xd1, 0xd1, 0xb6, 0xe7, 0x00, 0xf0, 0x69, 0xf8,
+	0x00, 0x28, 0xfb, 0xda, 0x01, 0x20, 0x00, 0x02, 0x2c, 0xe0, 0x32, 0x20, 0x01, 0x99, 0x02, 0x9a,
+	0x00, 0xf0, 0x34, 0xf8, 0x00, 0x28, 0x25, 0xd1, 0x34, 0x20, 0x01, 0x99, 0x02, 0x9a, 0xfb, 0x6a,
+	0x00, 0xf0, 0x2c, 0xf8, 0x1e, 0xe0, 0x32, 0x20, 0x03, 0x99, 0x0a, 0x00, 0x00, 0xf0, 0x26, 0xf8,
+	0x00, 0x28, 0x17, 0xd1, 0x33, 0x20, 0x01, 0x99, 0x3a, 0x6b, 0x04, 0x9b, 0xd2, 0x18, 0x02, 0x9b,
+	0x00, 0xf0, 0x1c, 0xf8, 0x0e, 0xe0, 0x01, 0x9b, 0x02, 0x9a, 0x00, 0x24, 0xe4, 0x43, 0x00, 0x2a,
+	0x05, 0xd0, 0x18, 0x78, 0x01, 0x33, 0x00, 0xf0, 0x4d, 0xf8, 0x01, 0x3a, 0xf9, 0xd1, 0xe1, 0x43,
+	0x00, 0x20, 0x00, 0xe0, 0x00, 0x21, 0x00, 0x90, 0x01, 0x91, 0x6b, 0x46, 0x08, 0x22, 0x18, 0x78,
+	0x01, 0x33, 0x00, 0xf0, 0x4f, 0xf8, 0x01, 0x3a, 0xf9, 0xd1, 0x4d, 0xe7, 0x00, 0xb5, 0x06, 0x90,
+	0x07, 0x91, 0x08, 0x92, 0x09, 0x93, 0xf8, 0x6a, 0x0a, 0x90, 0x06, 0xa8, 0x0b, 0xa9, 0xbe, 0x6a,
+	0x00, 0xf0, 0x03, 0xf8, 0x0b, 0x98, 0x02, 0xbc, 0x08, 0x47, 0x30, 0x47, 0x00, 0xb5, 0x00, 0xf0,
+	0x18, 0xf8, 0x00, 0x28, 0x06, 0xdb, 0x18, 0x70, 0x01, 0x33, 0x00, 0xf0, 0x23, 0xf8, 0x01, 0x3a,
+	0xf5, 0xd1, 0x00, 0x20, 0x02, 0xbc, 0x08, 0x47, 0x00, 0xb5, 0x00, 0xf0, 0x0a, 0xf8, 0x00, 0x28,
+	0x05, 0xdb, 0x84, 0x46, 0x00, 0xf0, 0x16, 0xf8, 0x60, 0x46, 0x02, 0xbc, 0x08, 0x47, 0x02, 0xbc,
+	0x94, 0xe7, 0xf9, 0x6a, 0x09, 0x01, 0x38, 0x69, 0x2e, 0x58, 0x78, 0x69, 0x06, 0x42, 0x04, 0xd1,
+	0x01, 0x39, 0xf8, 0xd1, 0x00, 0x20, 0xc0, 0x43, 0x70, 0x47, 0xb8, 0x69, 0x28, 0x58, 0xff, 0x21,
+	0x08, 0x40, 0x70, 0x47, 0x44, 0x40, 0x0f, 0x20, 0x20, 0x40, 0x80, 0x00, 0x40, 0x30, 0x38, 0x58,
+	0x24, 0x09, 0x44, 0x40, 0x0f, 0x20, 0x20, 0x40, 0x80, 0x00, 0x40, 0x30, 0x38, 0x58, 0x24, 0x09,
+	0x44, 0x40, 0x70, 0x47, 0xf9, 0x69, 0x69, 0x58, 0x3e, 0x6a, 0x31, 0x42, 0xfa, 0xd0, 0x79, 0x6a,
+	0x68, 0x50, 0x70, 0x47
+};
+
 /* Device properties */
 const DEVICE DevLst[] = {
 /*	 *Device        Sign     Code     Raw  Flash   *Map   Buff         Xfer   CRP   Sum */
@@ -324,25 +510,67 @@ const DEVICE DevLst[] = {
 };
 
 
-const DEVICE *Device;		/* Detected device property */
-const char *Del;		/* Delimiter character of ISP command */
+typedef struct {
+	uint8_t Data[IMG_PAGE];		/* Data of the page (0xFF if not loaded) */
+	uint8_t Load[IMG_PAGE / 8];	/* Bytes loaded by the previous files (a bit per byte) */
+	uint8_t File[IMG_PAGE / 8];	/* Bytes loaded by the current file */
+} PAGE;
+
+
+typedef struct {
+	long Line;				/* Number of lines parsed */
+	uint16_t Seg, Hadr;		/* Address expansion values of Intel Hex */
+} HEXSTATE;
+
+
+typedef struct {
+	const char* Name;		/* Input file name */
+	int Fd;					/* Input file */
+	int Bin;				/* Binary input (loaded at Base) */
+	uint32_t Base;			/* Load address of the binary input */
+	pthread_t Thread;		/* Loader thread */
+	pthread_mutex_t Lock;	/* Protects the members below and StreamPos of the sessions */
+	pthread_cond_t Cond;	/* Signaled on a progress of the loader or the sessions */
+	uint32_t Done;			/* The image below this address is complete */
+	uint32_t Range[2];		/* Address range loaded so far {lowest, highest} */
+	uint32_t Freed;			/* Pages below this address have been released (except sector 0) */
+	int End;				/* 0:loading, 1:end of input, 2:stopped (all sessions finished), -1:failed */
+	long Err;				/* Error code of the loader */
+} STREAM;
+
 
 uint32_t AddrRange[2];		/* Loaded address range {lowest, highest} */
-uint8_t Buffer[0x80000];	/* Flash data buffer (512K) */
+PAGE* Image[MAX_IMAGE / IMG_PAGE];	/* Loaded data (pages are allocated when data is loaded into it) */
+int Streaming;				/* The data file is streamed (programming starts before the end of input) */
+STREAM Stream;				/* Streamed data file */
 
 int Freq = 14748;		/* -f<freq> Oscillator frequency [kHz] */
 // int Port = 1;			/* -p<port> Port numnber */
-char Port[256] = "/dev/ttys1"; /* -p<port> Port name */
+char Port[1024] = "/dev/ttys1"; /* -p<port>[,<port>...] Port name(s) */
 // int Baud = 115200;		/* -p<port>:<bps> Bit rate */
 int Baud = 9600;		/* -p<port>:<bps> Bit rate */
 int Pause;				/* -w<mode> Pause before exit program */
 int Pol;				/* -c<flag> Invert signal polarity (b0:ER, b1:RS) */
 int Read;				/* -r Read operation */
+uint32_t ReadRange[2];	/* -r<start>-<end> Address range to read {start, end + 1} (0:populated sectors) */
 int Crp3;				/* -3 Do not block to program CRP3 and NO_ISP */
+int Diff;				/* -d Update changed sectors only */
+int EraseAll;			/* -e Erase entire flash memory */
+int Verify;				/* -v Verify flash memory */
+int IspOnly;			/* -i Write flash memory with ISP commands only (flash write code is not used) */
+int Stats;				/* --stats Report timing statistics */
+char StatsFile[256];	/* --stats=<file> Write timing statistics in JSON */
+char ServeSock[108];	/* --serve=<socket> Run as a daemon serving jobs on the UNIX domain socket */
+int SelfTest;			/* --test Check the data processing functions against known answers and measure their throughput */
+int DefVerify, DefVerifyOpt, DefDiff, DefEraseAll, DefCrp3;	/* Options given on the command line (defaults of the jobs) */
+int VerifyOpt;			/* -v<flag> Verify options (b0:without programming, b1:read back mismatched sectors) */
+
+SESSION Session[MAX_PORT];	/* Programming sessions (one per port) */
+const char* const PhName[N_PHASE] = { "sync", "probe", "compare", "erase", "write", "verify", "read", "exit" };
+int Sessions;			/* Number of sessions */
+int Gang;				/* Two or more ports are driven in parallel */
 
 
-struct termios tio, oldtio;
-struct timeval timeout = {0, 0};
 typedef enum {
 	CLRDTR,
 	CLRRTS,
@@ -379,71 +607,207 @@ FILE *open_cfgfile(char *filename)
 
 
 /*-----------------------------------------------------------------------
-  Hex format manupilations
+  Data image
 -----------------------------------------------------------------------*/
 
+/* Get data from the image (0xFF is returned for the bytes not loaded) */
+static
+void read_image (
+	uint32_t addr,		/* address of the data */
+	uint8_t* dst,		/* output buffer */
+	uint32_t count		/* number of bytes to read */
+)
+{
+	uint32_t ofs, n;
+
+
+	while (count) {
+		ofs = addr % IMG_PAGE;
+		n = IMG_PAGE - ofs;
+		if (n > count) n = count;
+		if (addr < MAX_IMAGE && Image[addr / IMG_PAGE]) {
+			memcpy(dst, &Image[addr / IMG_PAGE]->Data[ofs], n);
+		} else {
+			memset(dst, 0xFF, n);
+		}
+		addr += n; dst += n; count -= n;
+	}
+}
 
-/* Pick a hexdecimal value from hex record */
 
-uint32_t get_valh (
-	char **lp,	/* pointer to line read pointer */
-	int count, 	/* number of digits to get (2,4,6,8) */
-	uint8_t *sum	/* byte check sum */
-) {
-	uint32_t val = 0;
-	uint8_t n;
+/* Check if any data is loaded in the address range */
+static
+int image_used (
+	uint32_t addr,		/* start address (page aligned) */
+	uint32_t size		/* size of the range */
+)
+{
+	for ( ; size && addr < MAX_IMAGE; addr += IMG_PAGE, size -= (size > IMG_PAGE) ? IMG_PAGE : size) {
+		if (Image[addr / IMG_PAGE]) return 1;
+	}
+	return 0;
+}
+
+
+/* Check overlap of the current file with the previous files and commit it */
+static
+int commit_image (	/* 0:succeeded, 1:overlap found (address in *addr) */
+	uint32_t* addr
+)
+{
+	PAGE *pg;
+	uint32_t p, i, b;
+	int rc = 0;
 
 
-	do {
-		n = *(*lp)++;
-		if ((n -= '0') >= 10) {
-			if ((n -= 7) < 10) return 0xFFFFFFFF;
-			if (n > 0xF) return 0xFFFFFFFF;
+	for (p = 0; p < MAX_IMAGE / IMG_PAGE; p++) {
+		if ((pg = Image[p]) == NULL) continue;
+		for (i = 0; i < IMG_PAGE / 8; i++) {
+			if (!rc && (pg->Load[i] & pg->File[i])) {
+				for (b = 0; !(pg->Load[i] & pg->File[i] & 1 << b); b++) ;
+				*addr = p * IMG_PAGE + i * 8 + b;
+				rc = 1;
+			}
+			pg->Load[i] |= pg->File[i];
+			pg->File[i] = 0;
 		}
-		val = (val << 4) + n;
-		if (count & 1) *sum += (uint8_t)val;
-	} while (--count);
-	return val;
+	}
+	return rc;
+}
+
+
+
+
+/*-----------------------------------------------------------------------
+  Hex format manupilations
+-----------------------------------------------------------------------*/
+
+
+static uint8_t HexVal[256];	/* Hexdecimal digit to value (0x80:invalid) */
+static char HexStr[256][2];	/* Byte to hexdecimal digits */
+
+
+/* Initialize hexdecimal conversion tables */
+static
+void init_hexval (void)
+{
+	int i;
+
+
+	for (i = 0; i < 256; i++) {
+		HexVal[i] = (i >= '0' && i <= '9') ? i - '0' :
+					(i >= 'A' && i <= 'F') ? i - 'A' + 10 :
+					(i >= 'a' && i <= 'f') ? i - 'a' + 10 : 0x80;
+		HexStr[i][0] = "0123456789ABCDEF"[i >> 4];
+		HexStr[i][1] = "0123456789ABCDEF"[i & 15];
+	}
+}
+
+
+
+/* Pick bytes from hexdecimal digits of a hex record */
+static
+int get_hexbytes (	/* 0:succeeded, 1:invalid digit found */
+	const char* src,	/* pointer to the hexdecimal digits */
+	uint8_t* dst,		/* byte output buffer */
+	int count,			/* number of bytes to get */
+	uint8_t* sum		/* byte check sum */
+)
+{
+	const uint8_t *p = (const uint8_t*)src;
+	uint8_t hi, lo, s = *sum, err = 0;
+
+
+	while (count--) {
+		hi = HexVal[*p++]; lo = HexVal[*p++];
+		err |= hi | lo;
+		*dst = (hi << 4) | (lo & 0x0F);
+		s += *dst++;
+	}
+	*sum = s;
+	return err >> 7;
 }
 
 
 
+/* Store a record of data into the data image */
+static
+int store_record (	/* 0:succeeded, -4:not enough memory, -5:not in ascending order (streaming) */
+	uint32_t addr,		/* address of the data */
+	const uint8_t* dat,	/* data */
+	uint32_t count		/* number of data bytes */
+)
+{
+	PAGE *pg;
+	uint32_t a, ofs, n;
+
+
+	if (addr >= MAX_IMAGE || !count) return 0;
+	if (Streaming && addr < Stream.Done) return -5;	/* The image below it may have been programmed */
+	if (count > MAX_IMAGE - addr) count = MAX_IMAGE - addr;	/* clip by image size */
+	if (addr + count - 1 > AddrRange[1]) AddrRange[1] = addr + count - 1;	/* update data size information */
+	if (addr < AddrRange[0]) AddrRange[0] = addr;
+
+	while (count) {
+		pg = Image[addr / IMG_PAGE];
+		if (!pg) {	/* Allocate a blank page */
+			pg = calloc(1, sizeof (PAGE));
+			if (!pg) return -4;
+			memset(pg->Data, 0xFF, IMG_PAGE);
+			Image[addr / IMG_PAGE] = pg;
+		}
+		ofs = addr % IMG_PAGE;
+		n = IMG_PAGE - ofs;
+		if (n > count) n = count;
+		memcpy(&pg->Data[ofs], dat, n);		/* store the data */
+		for (a = ofs; a < ofs + n; ) {	/* mark the bytes loaded (overlap detection) */
+			if (!(a & 7) && a + 8 <= ofs + n) {
+				pg->File[a / 8] = 0xFF; a += 8;
+			} else {
+				pg->File[a / 8] |= 1 << (a & 7); a++;
+			}
+		}
+		addr += n; dat += n; count -= n;
+	}
+	return 0;
+}
+
+
 
-/* Load Intel Hex and Motorola S format file into data buffer */ 
+/* Load Intel Hex and Motorola S format text into the data image */
+/* The text can be given in pieces of whole lines, the state is carried over in *hs */
 
-long input_hexfile (
-	FILE* fp,			/* input stream */
-	uint8_t* buffer,		/* data input buffer */
-	uint32_t buffsize,		/* size of data buffer */
-	uint32_t* range		/* effective data size in the input buffer */
+long parse_hex (
+	const char* text,	/* hex text */
+	size_t size,		/* size of the hex text */
+	HEXSTATE* hs		/* parser state (zero at start of the file) */
 ) {
-	char line[600];			/* line input buffer */
-	char *lp;				/* line read pointer */
-	long lnum = 0;			/* input line number */
-	uint16_t seg = 0, hadr = 0;	/* address expantion values for intel hex */
+	const char *lp, *le, *end = text + size;
+	long lnum = hs->Line;	/* input line number */
+	uint16_t seg = hs->Seg, hadr = hs->Hadr;	/* address expantion values for intel hex */
 	uint32_t addr, count, n;
-	uint8_t sum;
+	uint8_t sum, rec[5 + 255 + 1];
+	int rc;
 
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
+	for (lp = text; lp < end; lp = le + 1) {
 		lnum++;
-		lp = &line[1]; sum = 0;
-
-		if (line[0] == ':') {	/* Intel Hex format */
-			if ((count = get_valh(&lp, 2, &sum)) > 0xFF) return lnum;	/* byte count */
-			if ((addr = get_valh(&lp, 4, &sum)) > 0xFFFF) return lnum;	/* offset */
+		le = memchr(lp, '\n', end - lp);
+		if (!le) le = end;
+		n = le - lp;	/* length of the line */
+		sum = 0;
+
+		if (lp[0] == ':') {	/* Intel Hex format */
+			if (n < 11 || get_hexbytes(lp + 1, rec, 4, &sum)) return lnum;	/* byte count, offset and block type */
+			count = rec[0];
+			addr = (rec[1] << 8) | rec[2];
+			if (n < 11 + count * 2 || get_hexbytes(lp + 9, &rec[4], count + 1, &sum)) return lnum;	/* data and check sum */
+			if (sum) return lnum;							/* test check sum */
 
-			switch (get_valh(&lp, 2, &sum)) {	/* block type? */
+			switch (rec[3]) {	/* block type? */
 				case 0x00 :	/* data */
-					addr += (seg << 4) + (hadr << 16);
-					while (count--) {
-						n = get_valh(&lp, 2, &sum);		/* pick a byte */
-						if (n > 0xFF) return lnum;
-						if (addr >= buffsize) continue;	/* clip by buffer size */
-						if (addr > range[1]) range[1] = addr;	/* update data size information */
-						if (addr < range[0]) range[0] = addr;
-						buffer[addr++] = (uint8_t)n;		/* store the data */
-					}
+					rc = store_record(addr + ((uint32_t)seg << 4) + ((uint32_t)hadr << 16), &rec[4], count);
+					if (rc) return rc;
 					break;
 
 				case 0x01 :	/* end */
@@ -452,82 +816,151 @@ long input_hexfile (
 
 				case 0x02 :	/* segment base [19:4] */
 					if (count != 2) return lnum;
-					seg = (uint16_t)get_valh(&lp, 4, &sum);
+					seg = (rec[4] << 8) | rec[5];
 					if (seg == 0xFFFF) return lnum;
 					break;
 
 				case 0x03 :	/* program start address (segment:offset) */
+				case 0x05 :	/* program start address (linear) */
 					if (count != 4) return lnum;
-					get_valh(&lp, 8, &sum);
 					break;
 
 				case 0x04 :	/* high address base [31:16] */
 					if (count != 2) return lnum;
-					hadr = (uint16_t)get_valh(&lp, 4, &sum);
+					hadr = (rec[4] << 8) | rec[5];
 					if (hadr == 0xFFFF) return lnum;
 					break;
 
-				case 0x05 :	/* program start address (linear) */
-					if (count != 4) return lnum;
-					get_valh(&lp, 8, &sum);
-					break;
-
 				default:	/* invalid block */
 					return lnum;
 			} /* switch */
-			if (get_valh(&lp, 2, &sum) > 0xFF) return lnum;	/* get check sum */
-			if (sum) return lnum;							/* test check sum */
 			continue;
 		} /* if */
 
-		if (line[0] == 'S') {	/* Motorola S format */
-			if ((*lp >= '1')&&(*lp <= '3')) {
-
-				switch (*lp++) {	/* record type? (S1/S2/S3) */
-					case '1' :
-						count = get_valh(&lp, 2, &sum) - 3;
-						if (count > 0xFF) return lnum;
-						addr = get_valh(&lp, 4, &sum);
-						if (addr > 0xFFFF) return lnum;
-						break;
-					case '2' :
-						count = get_valh(&lp, 2, &sum) - 4;
-						if (count > 0xFF) return lnum;
-						addr = get_valh(&lp, 6, &sum);
-						if (addr > 0xFFFFFF) return lnum;
-						break;
-					default :
-						count = get_valh(&lp, 2, &sum) - 5;
-						if (count > 0xFF) return lnum;
-						addr = get_valh(&lp, 8, &sum);
-						if (addr == 0xFFFFFFFF) return lnum;
-				}
-				while (count--) {
-					n = get_valh(&lp, 2, &sum);
-					if (n > 0xFF) return lnum;
-					if (addr >= buffsize) continue;	/* clip by buffer size */
-					if (addr > range[1]) range[1] = addr;	/* update data size information */
-					if (addr < range[0]) range[0] = addr;
-					buffer[addr++] = (uint8_t)n;		/* store the data */
-				}
-				if (get_valh(&lp, 2, &sum) > 0xFF) return lnum;	/* get check sum */
+		if (lp[0] == 'S') {	/* Motorola S format */
+			if (n >= 4 && lp[1] >= '1' && lp[1] <= '3') {
+				n = (n - 2) / 2;	/* number of bytes in the record */
+				if (get_hexbytes(lp + 2, rec, 1, &sum) || rec[0] >= n) return lnum;	/* byte count */
+				count = rec[0];
+				if (get_hexbytes(lp + 4, &rec[1], count, &sum)) return lnum;	/* address, data and check sum */
 				if (sum != 0xFF) return lnum;					/* test check sum */
-			} /* switch */
+				n = lp[1] - '0' + 1;	/* address width (S1:2, S2:3, S3:4 bytes) */
+				if (count < n + 1) return lnum;
+				for (addr = 0, count = 1; count <= n; count++) addr = (addr << 8) | rec[count];
+				rc = store_record(addr, &rec[n + 1], rec[0] - n - 1);
+				if (rc) return rc;
+			}
 			continue;
 		} /* if */
 
-		if (line[0] >= ' ') return lnum;
-	} /* while */
+		if (n && (uint8_t)lp[0] >= ' ') return lnum;
+	} /* for */
 
-	return feof(fp) ? 0 : -1;
+	hs->Line = lnum; hs->Seg = seg; hs->Hadr = hadr;
+	return 0;
 }
 
 
 
-/* Put an Intel Hex data block */
+/* Map a file into memory */
+/* The file is mapped, or read into a memory block if it cannot be mapped (pipe or device) */
 
-void put_hexline (
-	FILE* fp,			/* output stream */
+char* map_file (		/* returns pointer to the file image (NULL:failed) */
+	int fd,				/* input file */
+	size_t* fsize,		/* size of the file image */
+	int* mapped			/* 1:mapped, 0:read into heap */
+) {
+	struct stat st;
+	char *text = NULL, *p;
+	size_t size = 0, bsize = 0;
+	ssize_t rc;
+
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text != MAP_FAILED) {
+			madvise(text, st.st_size, MADV_SEQUENTIAL);
+			*fsize = st.st_size;
+			*mapped = 1;
+			return text;
+		}
+		text = NULL;
+	}
+
+	for (;;) {	/* Read the file in chunks */
+		if (size == bsize) {
+			bsize = bsize ? bsize * 2 : 0x10000;
+			p = realloc(text, bsize);
+			if (!p) {
+				free(text);
+				return NULL;
+			}
+			text = p;
+		}
+		rc = read(fd, text + size, bsize - size);
+		if (rc == 0) break;
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			free(text);
+			return NULL;
+		}
+		size += rc;
+	}
+	*fsize = size;
+	*mapped = 0;
+	return text;
+}
+
+
+void unmap_file (
+	char* text,
+	size_t size,
+	int mapped
+) {
+	if (mapped) {
+		munmap(text, size);
+	} else {
+		free(text);
+	}
+}
+
+
+
+/* Load loadable segments of an ELF file into the data image */
+
+long input_elf (		/* 0:succeeded, -2:invalid ELF file, -4:not enough memory */
+	const uint8_t* img,	/* ELF file image */
+	size_t size			/* size of the file image */
+) {
+	const uint8_t *ph;
+	uint32_t phoff, phsize, phnum, ofs, paddr, fsz;
+
+
+	/* Check ELF header (32-bit little endian) */
+	if (size < 52 || memcmp(img, "\177ELF", 4) || img[4] != 1 || img[5] != 1) return -2;
+	phoff = LD_DWORD(&img[28]);			/* e_phoff */
+	phsize = img[42] | img[43] << 8;	/* e_phentsize */
+	phnum = img[44] | img[45] << 8;		/* e_phnum */
+	if (phsize < 32 || phoff > size || (size - phoff) / phsize < phnum) return -2;
+
+	for (ph = &img[phoff]; phnum; phnum--, ph += phsize) {	/* Pick PT_LOAD segments */
+		if (LD_DWORD(&ph[0]) != 1) continue;	/* p_type */
+		ofs = LD_DWORD(&ph[4]);		/* p_offset */
+		paddr = LD_DWORD(&ph[12]);	/* p_paddr (load address) */
+		fsz = LD_DWORD(&ph[16]);	/* p_filesz */
+		if (ofs > size || fsz > size - ofs) return -2;
+		if (store_record(paddr, &img[ofs], fsz)) return -4;
+	}
+
+	return 0;
+}
+
+
+
+/* Put an Intel Hex data block into the output buffer */
+
+char* put_hexline (		/* returns the end of the line put */
+	char* dst,				/* output buffer */
 	const uint8_t* buffer,	/* pointer to data buffer */
 	uint16_t ofs,			/* block offset address */
 	uint8_t count,			/* data byte count */
@@ -536,17 +969,23 @@ void put_hexline (
 	uint8_t sum;
 
 	/* Byte count, Offset address and Record type */
-	fprintf(fp, ":%02X%04X%02X", count, ofs, type);
+	*dst++ = ':';
+	memcpy(dst, HexStr[count], 2); dst += 2;
+	memcpy(dst, HexStr[ofs >> 8], 2); dst += 2;
+	memcpy(dst, HexStr[ofs & 0xFF], 2); dst += 2;
+	memcpy(dst, HexStr[type], 2); dst += 2;
 	sum = count + (ofs >> 8) + ofs + type;
 
 	/* Data bytes */
 	while (count--) {
-		fprintf(fp, "%02X", *buffer);
+		memcpy(dst, HexStr[*buffer], 2); dst += 2;
 		sum += *buffer++;
 	}
 
 	/* Check sum */
-	fprintf(fp, "%02X\n", (uint8_t)-sum);
+	memcpy(dst, HexStr[(uint8_t)-sum], 2); dst += 2;
+	*dst++ = '\n';
+	return dst;
 }
 
 
@@ -562,886 +1001,3921 @@ void output_ihex (
 	uint16_t ofs = 0;
 	uint8_t hadr[2] = {0,0}, d, n;
 	uint32_t bc = datasize;
+	static char obuf[0x10000];	/* output buffer */
+	char *op = obuf;
 
 
 	while (bc) {
+		if (op - obuf > (int)(sizeof obuf - 3 * (1 + 2 * (5 + 255) + 1))) {	/* flush output buffer if it can overflow */
+			fwrite(obuf, 1, op - obuf, fp);
+			op = obuf;
+		}
 		if ((ofs == 0) && (datasize > 0x10000)) {	/* A16 changed? */
 			if (datasize > 0x100000) {
-				put_hexline(fp, hadr, 0, 2, 4);
+				op = put_hexline(op, hadr, 0, 2, 4);
 				hadr[1]++;
 			} else {
-				put_hexline(fp, hadr, 0, 2, 2);
+				op = put_hexline(op, hadr, 0, 2, 2);
 				hadr[0] += 0x10;
 			}
 		}
 		if (bc >= blocksize) {	/* full data block */
 			for (d = 0xFF, n = 0; n < blocksize; n++) d &= *(buffer+n);
-			if (d != 0xFF) put_hexline(fp, buffer, ofs, blocksize, 0);
+			if (d != 0xFF) op = put_hexline(op, buffer, ofs, blocksize, 0);
 			buffer += blocksize;
 			bc -= blocksize;
 			ofs += blocksize;
 		} else {				/* fractional data block */
 			for (d = 0xFF, n = 0; n < bc; n++) d &= *(buffer+n);
-			if (d != 0xFF) put_hexline(fp, buffer, ofs, (uint8_t)bc, 0);
+			if (d != 0xFF) op = put_hexline(op, buffer, ofs, (uint8_t)bc, 0);
 			bc = 0;
 		}
 	}
 
-	put_hexline(fp, NULL, 0, 0, 1);	/* End block */
+	op = put_hexline(op, NULL, 0, 0, 1);	/* End block */
+	fwrite(obuf, 1, op - obuf, fp);
 }
 
 
 
 /*-----------------------------------------------------------------------
-  Command line analysis
+  Streaming input
 -----------------------------------------------------------------------*/
 
-
+/* Publish the progress of the loader to the sessions */
+/* The image below the page of the highest address loaded is complete because the input is in ascending order */
 static
-int load_commands (int argc, char** argv)
+void stream_update (
+	int end,		/* 0:loading, 1:end of input, 2:stopped, -1:failed */
+	long err		/* Error code (failed) */
+)
 {
-	// char *cp, *cmdlst[10], cmdbuff[256];
-	char *cp, *pp, *cmdlst[10], cmdbuff[256];
-	int cmd;
-	FILE *fp;
-	long n;
+	pthread_mutex_lock(&Stream.Lock);
+	if (AddrRange[1] > 0) Stream.Done = AddrRange[1] & ~(IMG_PAGE - 1);
+	if (end > 0) Stream.Done = MAX_IMAGE;
+	Stream.Range[0] = AddrRange[0]; Stream.Range[1] = AddrRange[1];
+	Stream.End = end;
+	Stream.Err = err;
+	pthread_cond_broadcast(&Stream.Cond);
+	pthread_mutex_unlock(&Stream.Lock);
+}
 
 
-	/* Clear flash data buffer */
-	memset(Buffer, 0xFF, sizeof Buffer);	/* Default value (if not loaded) */
-	AddrRange[0] = sizeof(Buffer);	/* Lowest address */
-	AddrRange[1] = 0;				/* Highest address */
 
-	cmd = 0; cp = cmdbuff;
+/* Wait until the slowest session comes within the window (bounds the memory held by the image) */
+static
+int stream_room (void)	/* 1:continue loading, 0:all sessions have finished */
+{
+	uint32_t pos;
+	int n;
 
-	/* Import ini file as command line parameters */
-	fp = open_cfgfile(INIFILE);
-	if (fp != NULL) {
-		while (fgets(cp, cmdbuff + sizeof cmdbuff - cp, fp) != NULL) {
-			if (cmd >= (sizeof cmdlst / sizeof cmdlst[0] - 1)) break;
-			if (*cp <= ' ') break;
-			while (cp[strlen(cp) - 1] <= ' ') cp[strlen(cp) - 1] = 0;
-			cmdlst[cmd++] = cp; cp += strlen(cp) + 1;
+
+	pthread_mutex_lock(&Stream.Lock);
+	for (;;) {
+		for (pos = 0xFFFFFFFF, n = 0; n < Sessions; n++) {
+			if (Session[n].StreamPos < pos) pos = Session[n].StreamPos;
 		}
-		fclose(fp);
+		if (pos == 0xFFFFFFFF || Stream.Done < pos + STREAM_WINDOW) break;
+		pthread_cond_wait(&Stream.Cond, &Stream.Lock);
 	}
+	pthread_mutex_unlock(&Stream.Lock);
+	return pos != 0xFFFFFFFF;
+}
 
-	/* Get command line parameters */
-	while (--argc && (cmd < (sizeof cmdlst / sizeof cmdlst[0] - 1))) {
-		cmdlst[cmd++] = *++argv;
+
+
+/* Load the data file from the input stream into the image (thread function) */
+static
+void* load_stream (
+	void* arg
+)
+{
+	HEXSTATE hs;
+	char *buf, *le;
+	size_t len = 0;
+	ssize_t rc;
+	uint32_t ofs = 0;
+	long err = 0;
+	int end = 2;
+
+
+	(void)arg;
+	memset(&hs, 0, sizeof hs);
+	buf = malloc(STREAM_CHUNK);
+	if (!buf) err = -4;
+	while (!err && stream_room()) {
+		rc = read(Stream.Fd, buf + len, STREAM_CHUNK - len);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			err = -1;
+			break;
+		}
+		if (rc == 0) end = 1;
+		if (Stream.Bin) {	/* Binary file is stored as it arrives */
+			if (rc == 0) break;
+			err = store_record(Stream.Base + ofs, (uint8_t*)buf, rc);
+			ofs += rc;
+		} else {			/* Hex text is parsed in whole lines */
+			if (rc == 0) {	/* End of input (the last line may not be terminated) */
+				if (len) err = parse_hex(buf, len, &hs);
+				break;
+			}
+			len += rc;
+			if (hs.Line == 0 && len >= 4 && !memcmp(buf, "\177ELF", 4)) {
+				err = -6;
+				break;
+			}
+			for (le = buf + len; le > buf && le[-1] != '\n'; le--) ;
+			if (le == buf) {	/* No line end in the buffer */
+				if (len == STREAM_CHUNK) err = hs.Line + 1;
+				continue;
+			}
+			err = parse_hex(buf, le - buf, &hs);
+			len -= le - buf;
+			memmove(buf, le, len);
+		}
+		if (!err) stream_update(0, 0);
 	}
-	cmdlst[cmd] = NULL;
+	free(buf);
+	stream_update(err ? -1 : end, err);
 
-	/* Analyze command line parameters... */
-	for (cmd = 0; cmdlst[cmd] != NULL; cmd++) {
-		cp = cmdlst[cmd];
+	return NULL;
+}
 
-		if (*cp == '-') {	/* Command switches... */
-			cp++;
-			switch (tolower(*cp++)) {
-				case 'f' :	/* -f<num> (oscillator frequency) */
-					Freq = strtoul(cp, &cp, 10);
-					break;
 
-				// case 'p' :	/* -p<num>[:<bps>] (control port and bit rate) */
-				case 'p' :	/* -p<name>[:<bps>] (control port and bit rate) */
-					pp = Port;
-					while (*cp != ':' && *cp > ' ') *pp++ = *cp++;
-					*pp = '\0';
-					// Port = strtoul(cp, &cp, 10);
-					if(*cp == ':')
-						Baud = strtoul(cp+1, &cp, 10);
-					break;
 
-				case 'r' :	/* -r (read command) */
-					Read = 1;
-					break;
+/* Wait until the streamed image below the address is complete or the input ends */
+static
+int stream_wait (	/* 0:complete, 1:end of input, -1:input failed */
+	uint32_t addr,		/* Address to wait for */
+	uint32_t* done,		/* The image below this address is complete */
+	uint32_t* range		/* Address range loaded so far */
+)
+{
+	int end;
 
-				case 'w' :	/* -w<num> (pause before exit 1:on error or 2:always) */
-					Pause = strtoul(cp, &cp, 10);
-					break;
 
-				case 'c' :	/* -c<flag> (polarity of control signals) */
-					Pol = strtoul(cp, &cp, 10);
-					break;
+	pthread_mutex_lock(&Stream.Lock);
+	while (!Stream.End && Stream.Done < addr) pthread_cond_wait(&Stream.Cond, &Stream.Lock);
+	end = Stream.End;
+	*done = Stream.Done;
+	range[0] = Stream.Range[0]; range[1] = Stream.Range[1];
+	pthread_mutex_unlock(&Stream.Lock);
+	return end;
+}
 
-				case '3' :	/* -3 (force programmed CRP3 and NO_ISP) */
-					Crp3 = 1;
-					break;
 
-				default :	/* invalid command */
-					return 1;
-			} /* switch */
-			if(*cp >= ' ') return 1;	/* option trails garbage */
-		} /* if */
 
-		else {	/* HEX Files */
-			fprintf(stderr, "Loading \"%s\"...", cp);
-			if ((fp = fopen(cp, "rt")) == NULL) {
-				fprintf(stderr, "Unable to open.\n");
-				return 2;
-			}
-			n = input_hexfile(fp, Buffer, sizeof Buffer, AddrRange);
-			fclose(fp);
-			if (n) {
-				if (n < 0) {
-					fprintf(stderr, "file access failure.\n");
-				} else {
-					fprintf(stderr, "hex format error at line %ld.\n", n);
-				}
-				return 2;
-			}
-			fprintf(stderr, "passed.\n");
-		} /* else */
+/* Report the progress of a session and release the pages no longer needed by any session */
+/* Pages of sector 0 are kept because it is written at last */
+static
+void stream_release (
+	SESSION* ses,
+	uint32_t pos		/* The image below this address is no longer needed by the session (0xFFFFFFFF:finished) */
+)
+{
+	uint32_t p, min, keep;
+	int n;
 
-	} /* for */
 
-	return 0;
+	pthread_mutex_lock(&Stream.Lock);
+	ses->StreamPos = pos;
+	for (min = 0xFFFFFFFF, keep = 0, n = 0; n < Sessions; n++) {
+		if (Session[n].StreamPos < min) min = Session[n].StreamPos;
+		if (Session[n].Device && Session[n].Device->SectMap[1] > keep) keep = Session[n].Device->SectMap[1];
+	}
+	if (min > Stream.Done) min = Stream.Done;	/* The loader may be storing data above it */
+	for (p = Stream.Freed / IMG_PAGE; p < min / IMG_PAGE; p++) {
+		if (p * IMG_PAGE < keep) continue;
+		free(Image[p]);
+		Image[p] = NULL;
+	}
+	if (min > Stream.Freed) Stream.Freed = min;
+	pthread_cond_broadcast(&Stream.Cond);
+	pthread_mutex_unlock(&Stream.Lock);
 }
 
 
 
+
 /*-----------------------------------------------------------------------
-  LPC 2000/1000 programming controls
+  Command line analysis
 -----------------------------------------------------------------------*/
 
-/* Get top address of the sector contains given address */
+
+/* Split the load address off the binary file name */
 static
-uint32_t adr2sect (
-	uint32_t addr
+char* split_addr (	/* Load address string (NULL:not a binary file) */
+	char* cp,		/* File name (<binary file>@<address> is terminated at '@') */
+	uint32_t* base	/* Load address */
 )
 {
-	uint32_t n;
+	char *bp, *pp;
 
-	for (n = 1; addr >= Device->SectMap[n]; n++) ;
-	return n - 1;
+
+	*base = 0;
+	bp = strrchr(cp, '@');
+	if (bp) {	/* Binary file with load address */
+		*bp++ = 0;
+		*base = strtoul(bp, &pp, 0);
+		if (*pp) {	/* Not an address */
+			*--bp = '@';
+			bp = NULL;
+		}
+	}
+	return bp;
 }
 
 
 
-/* Create an uuencoded asciz string from a byte array */
+/* Show the reason of a load failure */
 static
-void uuencode (
-	const void* src,	/* Pointer to the input data */
-	int srcsize,		/* Size of input data (0 to 45) */
-	char* dst			/* Pointer to the output buffer */
+void put_load_error (
+	long n,			/* Error code */
+	uint32_t addr	/* Address of the overlap */
 )
 {
-	const unsigned char *bin = (const unsigned char*)src;
-	unsigned char c1, c2, c3;
-	char c;
-	int cc;
+	if (n == -1) {
+		fprintf(stderr, "file access failure.\n");
+	} else if (n == -2) {
+		fprintf(stderr, "invalid ELF file.\n");
+	} else if (n == -4) {
+		fprintf(stderr, "not enough memory.\n");
+	} else if (n == -3) {
+		fprintf(stderr, "overlaps with data loaded from previous file at %05X.\n", addr);
+	} else if (n == -5) {
+		fprintf(stderr, "data is not in ascending address order (needed to be streamed).\n");
+	} else if (n == -6) {
+		fprintf(stderr, "ELF file cannot be streamed.\n");
+	} else {
+		fprintf(stderr, "hex format error at line %ld.\n", n);
+	}
+}
 
 
-	if (srcsize >= 0 || srcsize <= 45) {
-		c = srcsize + 0x20;
-		*dst++ = (c == ' ') ? '`' : c;
 
-		for (cc = 1; srcsize > 0; srcsize -= 3, cc += 4) {
-			c1 = *bin++;
-			c2 = c3 = 0;
-			if (srcsize >= 2) {
-				c2 = *bin++;
-				if (srcsize >= 3) {
-					c3 = *bin++;
-				}
-			}
-			c = (c1 >> 2) + 0x20;
-			*dst++ = (c == ' ') ? '`' : c;
-			c = ((c1 & 3) << 4) + (c2 >> 4) + 0x20;
-			*dst++ = (c == ' ') ? '`' : c;
-			c = ((c2 & 15) << 2) + (c3 >> 6) + 0x20;
-			*dst++ = (c == ' ') ? '`' : c;
-			c = (c3 & 63) + 0x20;
-			*dst++ = (c == ' ') ? '`' : c;
-		}
-	}
+/* Load a data file into the image */
+static
+int load_file (	/* 0:succeeded, 2:failed */
+	char* cp		/* File name (hex, S-record, ELF or <binary file>@<address>) */
+)
+{
+	int fd, mapped;
+	long n;
+	char *bp, *img;
+	size_t size;
+	uint32_t base;
+	HEXSTATE hs;
+
+
+	fprintf(stderr, "Loading \"%s\"...", cp);
+	bp = split_addr(cp, &base);
+	if ((fd = open(cp, O_RDONLY)) < 0) {
+		fprintf(stderr, "Unable to open.\n");
+		return 2;
+	}
+	img = map_file(fd, &size, &mapped);
+	close(fd);
+	if (!img) {
+		n = -1;
+	} else {
+		if (bp) {
+			n = store_record(base, (uint8_t*)img, size);
+		} else if (size >= 4 && !memcmp(img, "\177ELF", 4)) {
+			n = input_elf((uint8_t*)img, size);
+		} else {
+			memset(&hs, 0, sizeof hs);
+			n = parse_hex(img, size, &hs);
+		}
+		unmap_file(img, size, mapped);
+	}
+	if (!n && commit_image(&base)) n = -3;	/* Check overlap with the previous files */
+	if (n) {
+		put_load_error(n, base);
+		return 2;
+	}
+	fprintf(stderr, "passed.\n");
+
+	return 0;
+}
+
+
+
+/* Open a data file to be streamed if it is the standard input ("-") or a pipe */
+/* Programming starts while the file is being loaded instead of after the whole file is loaded */
+static
+int open_stream (	/* 0:opened, 1:not a stream, 2:failed */
+	char* cp		/* File name (hex, S-record or <binary file>@<address>) */
+)
+{
+	struct stat st;
+	char *bp;
+	uint32_t base;
+	int fd;
+
+
+	bp = split_addr(cp, &base);
+	if (strcmp(cp, "-") && (stat(cp, &st) || !S_ISFIFO(st.st_mode))) {
+		if (bp) bp[-1] = '@';
+		return 1;
+	}
+	if (Streaming || AddrRange[0] != MAX_IMAGE) {
+		MESS("A streamed file cannot be loaded with other files.\n");
+		return 2;
+	}
+	fd = strcmp(cp, "-") ? open(cp, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open \"%s\".\n", cp);
+		return 2;
+	}
+	Stream.Name = cp;
+	Stream.Fd = fd;
+	Stream.Bin = (bp != NULL);
+	Stream.Base = base;
+	Streaming = 1;
+	return 0;
+}
+
+
+
+/* Start loading the streamed file */
+static
+int start_stream (void)	/* 0:started, 1:failed */
+{
+	pthread_mutex_init(&Stream.Lock, NULL);
+	pthread_cond_init(&Stream.Cond, NULL);
+	return pthread_create(&Stream.Thread, NULL, load_stream, NULL) ? 1 : 0;
+}
+
+
+
+/* Wait for the end of the streamed file and show the result */
+static
+int end_stream (	/* Result code */
+	int rc			/* Result code of programming */
+)
+{
+	pthread_join(Stream.Thread, NULL);
+	fprintf(stderr, "Streaming \"%s\"...", Stream.Name);
+	if (Stream.End < 0) {
+		put_load_error(Stream.Err, 0);
+		return rc ? rc : 2;
+	}
+	if (Stream.End != 1) {
+		fprintf(stderr, "aborted.\n");
+		return rc;
+	}
+	fprintf(stderr, "passed.\n");
+	fprintf(stderr, "Loaded address range is %05X-%05X.\n", AddrRange[0], AddrRange[1]);
+	return rc;
+}
+
+
+
+static
+int load_commands (int argc, char** argv)
+{
+	// char *cp, *cmdlst[10], cmdbuff[256];
+	char *cp, *pp, *cmdlst[10], cmdbuff[256];
+	int cmd, n;
+	FILE *fp;
+
+
+	init_hexval();
+
+	/* Clear data image */
+	AddrRange[0] = MAX_IMAGE;	/* Lowest address */
+	AddrRange[1] = 0;				/* Highest address */
+
+	cmd = 0; cp = cmdbuff;
+
+	/* Import ini file as command line parameters */
+	fp = open_cfgfile(INIFILE);
+	if (fp != NULL) {
+		while (fgets(cp, cmdbuff + sizeof cmdbuff - cp, fp) != NULL) {
+			if (cmd >= (sizeof cmdlst / sizeof cmdlst[0] - 1)) break;
+			if (*cp <= ' ') break;
+			while (cp[strlen(cp) - 1] <= ' ') cp[strlen(cp) - 1] = 0;
+			cmdlst[cmd++] = cp; cp += strlen(cp) + 1;
+		}
+		fclose(fp);
+	}
+
+	/* Get command line parameters */
+	while (--argc && (cmd < (sizeof cmdlst / sizeof cmdlst[0] - 1))) {
+		cmdlst[cmd++] = *++argv;
+	}
+	cmdlst[cmd] = NULL;
+
+	/* Analyze command line parameters... */
+	for (cmd = 0; cmdlst[cmd] != NULL; cmd++) {
+		cp = cmdlst[cmd];
+
+		if (*cp == '-' && cp[1] && cp[1] != '@') {	/* Command switches... ("-" is the standard input) */
+			cp++;
+			switch (tolower(*cp++)) {
+				case 'f' :	/* -f<num> (oscillator frequency) */
+					Freq = strtoul(cp, &cp, 10);
+					break;
+
+				// case 'p' :	/* -p<num>[:<bps>] (control port and bit rate) */
+				case 'p' :	/* -p<name>[,<name>...][:<bps>] (control port(s) and bit rate) */
+					pp = Port;
+					while (*cp != ':' && *cp > ' ' && pp < &Port[sizeof Port - 1]) *pp++ = *cp++;
+					*pp = '\0';
+					// Port = strtoul(cp, &cp, 10);
+					if(*cp == ':')
+						Baud = strtoul(cp+1, &cp, 10);
+					break;
+
+				case 'r' :	/* -r[<start>-<end>] (read command) */
+					Read = 1;
+					if (isdigit((uint8_t)*cp)) {	/* Address range to read */
+						ReadRange[0] = strtoul(cp, &cp, 0);
+						if (*cp++ != '-') return 1;
+						ReadRange[1] = strtoul(cp, &cp, 0) + 1;
+						if (ReadRange[1] <= ReadRange[0]) return 1;
+					}
+					break;
+
+				case 'w' :	/* -w<num> (pause before exit 1:on error or 2:always) */
+					Pause = strtoul(cp, &cp, 10);
+					break;
+
+				case 'c' :	/* -c<flag> (polarity of control signals) */
+					Pol = strtoul(cp, &cp, 10);
+					break;
+
+				case '3' :	/* -3 (force programmed CRP3 and NO_ISP) */
+					Crp3 = 1;
+					break;
+
+				case 'd' :	/* -d (update changed sectors only) */
+					Diff = 1;
+					break;
+
+				case 'e' :	/* -e (erase entire flash memory) */
+					EraseAll = 1;
+					break;
+
+				case 'i' :	/* -i (write with ISP commands only) */
+					IspOnly = 1;
+					break;
+
+				case '-' :	/* --stats[=<file>] (report timing statistics), --serve=<socket> (daemon mode), --test (self test) */
+					if (!strcmp(cp, "test")) {
+						SelfTest = 1;
+						cp += 4;
+						break;
+					}
+					if (!strncmp(cp, "serve=", 6)) {
+						cp += 5;
+						pp = ServeSock;
+						while (*++cp > ' ' && pp < &ServeSock[sizeof ServeSock - 1]) *pp++ = *cp;
+						*pp = '\0';
+						break;
+					}
+					if (strncmp(cp, "stats", 5)) return 1;
+					cp += 5;
+					Stats = 1;
+					if (*cp == '=') {
+						pp = StatsFile;
+						while (*++cp > ' ' && pp < &StatsFile[sizeof StatsFile - 1]) *pp++ = *cp;
+						*pp = '\0';
+					}
+					break;
+
+				case 'v' :	/* -v[<flag>] (verify flash memory) */
+					Verify = 1;
+					VerifyOpt = strtoul(cp, &cp, 10);
+					break;
+
+				default :	/* invalid command */
+					return 1;
+			} /* switch */
+			if(*cp >= ' ') return 1;	/* option trails garbage */
+		} /* if */
+
+		else {	/* Data Files (hex, S-record, ELF or binary with @<address>) */
+			if (Streaming) {
+				MESS("A streamed file cannot be loaded with other files.\n");
+				return 2;
+			}
+			n = open_stream(cp);
+			if (n == 2 || (n == 1 && load_file(cp))) return 2;
+		} /* else */
+
+	} /* for */
+
+	if (EraseAll && Diff) {	/* -e erases the sectors that -d would keep */
+		MESS("-e and -d cannot be used together.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------------
+  LPC 2000/1000 programming controls
+-----------------------------------------------------------------------*/
+
+/* Get top address of the sector contains given address */
+static
+uint32_t adr2sect (
+	const DEVICE* dev,
+	uint32_t addr
+)
+{
+	uint32_t n;
+
+	for (n = 1; addr >= dev->SectMap[n]; n++) ;
+	return n - 1;
+}
+
+
+
+/* Get sector map of the sectors from sector 0 to the sector contains given address */
+static
+uint64_t lower_sects (
+	const DEVICE* dev,
+	uint32_t addr
+)
+{
+	uint32_t sn;
+
+	sn = adr2sect(dev, addr);
+	return (sn >= 63) ? ~(uint64_t)0 : SECT_BIT(sn + 1) - 1;
+}
+
+
+
+/* Get sector map of the sectors with any data loaded */
+static
+uint64_t image_sects (
+	const DEVICE* dev
+)
+{
+	uint32_t sn, ns;
+	uint64_t map = 0;
+
+
+	ns = adr2sect(dev, dev->FlashSize - 1) + 1;	/* Number of sectors */
+	for (sn = 0; sn < ns; sn++) {
+		if (image_used(dev->SectMap[sn], dev->SectMap[sn + 1] - dev->SectMap[sn])) map |= SECT_BIT(sn);
+	}
+	return map;
+}
+
+
+
+/* Get current time in unit of second */
+static
+double get_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/* Put a message of the session (recorded instead of displayed in gang mode) */
+static
+void put_mess (
+	SESSION* ses,
+	const char* fmt,
+	...
+)
+{
+	va_list ap;
+
+
+	va_start(ap, fmt);
+	if (!Gang) {
+		vfprintf(stderr, fmt, ap);
+	} else {
+		if (strcmp(fmt, ".")) {	/* Progress indicator is not recorded */
+			vsnprintf(ses->Msg, sizeof ses->Msg, fmt, ap);
+		}
+	}
+	va_end(ap);
+}
+
+
+
+/* Start a processing phase */
+static
+void begin_phase (
+	SESSION* ses
+)
+{
+	ses->PhStart = get_time();
+	ses->PhWire0 = ses->WireCnt;
+	ses->PhData0 = ses->DataCnt;
+}
+
+
+/* End a processing phase and accumulate its time and transferred bytes */
+static
+void end_phase (
+	SESSION* ses,
+	phase_t ph
+)
+{
+	ses->PhTime[ph] += get_time() - ses->PhStart;
+	ses->PhWire[ph] += ses->WireCnt - ses->PhWire0;
+	ses->PhData[ph] += ses->DataCnt - ses->PhData0;
+}
+
+
+/* Record a round trip time of a command */
+static
+void add_rtt (
+	SESSION* ses,
+	char cmd,		/* Command character */
+	double t		/* Round trip time [sec] */
+)
+{
+	const char *cp = strchr(RTT_CMDS, cmd);
+	RTTSTAT *st;
+	int n;
+
+
+	if (!cmd || !cp) return;
+	st = &ses->Rtt[cp - RTT_CMDS];
+	if (!st->Count || t < st->Min) st->Min = t;
+	if (t > st->Max) st->Max = t;
+	st->Sum += t;
+	st->Count++;
+	for (n = 0; n < RTT_BINS - 1 && t > 0.0001 * (1 << n); n++) ;
+	st->Hist[n]++;
+}
+
+
+
+/* Characters of uuencode (0 is encoded as '`' instead of ' ') */
+static const char UuEnc[] = "`!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_";
+static uint8_t UuDec[256];	/* Decoding table (0x80:invalid character) */
+static int UuSimd;			/* Use SSSE3 encoder */
+
+
+#ifdef USE_X86_SIMD
+/* Encode 12 bytes into 16 uuencode characters (reads 16 bytes from the source) */
+__attribute__((target("ssse3")))
+static
+void uuencode_ssse3 (
+	const uint8_t* bin,
+	char* dst
+)
+{
+	__m128i in, t0, t1, idx;
+
+
+	/* Split each 3 bytes into four 6-bit values */
+	in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)bin), _mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1));
+	t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t0, t1);
+	/* Map the values to characters (' '+n, '`' for 0) */
+	idx = _mm_add_epi8(_mm_add_epi8(idx, _mm_set1_epi8(0x20)), _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_setzero_si128()), _mm_set1_epi8(0x40)));
+	_mm_storeu_si128((__m128i*)dst, idx);
+}
+#endif
+
+
+/* Initialize uuencode/uudecode tables */
+static
+void init_uucode (void)
+{
+	int i;
+
+
+	for (i = 0; i < 256; i++) {
+		UuDec[i] = (i >= 0x20 && i <= 0x60) ? (i - 0x20) & 63 : 0x80;
+	}
+#ifdef USE_X86_SIMD
+	UuSimd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+
+
+/* Create an uuencoded asciz string from a byte array */
+static
+void uuencode (
+	const void* src,	/* Pointer to the input data */
+	int srcsize,		/* Size of input data (0 to 45) */
+	char* dst			/* Pointer to the output buffer */
+)
+{
+	const unsigned char *bin = (const unsigned char*)src;
+	unsigned char c1, c2, c3;
+
+
+	if (srcsize >= 0 && srcsize <= 45) {
+		*dst++ = UuEnc[srcsize];
+
+#ifdef USE_X86_SIMD
+		if (UuSimd) {
+			for ( ; srcsize >= 16; srcsize -= 12, bin += 12, dst += 16) {	/* 12 bytes at a time while 16 bytes can be read */
+				uuencode_ssse3(bin, dst);
+			}
+		}
+#endif
+		for ( ; srcsize > 0; srcsize -= 3) {
+			c1 = *bin++;
+			c2 = (srcsize >= 2) ? *bin++ : 0;
+			c3 = (srcsize >= 3) ? *bin++ : 0;
+			*dst++ = UuEnc[c1 >> 2];
+			*dst++ = UuEnc[((c1 & 3) << 4) | (c2 >> 4)];
+			*dst++ = UuEnc[((c2 & 15) << 2) | (c3 >> 6)];
+			*dst++ = UuEnc[c3 & 63];
+		}
+	}
 	*dst = 0;
 }
 
 
 
-/* Create a byte array from an uuencoded string */
+/* Create a byte array from an uuencoded string */
+static
+int uudecode (				/* Returns number of bytes decoded (-1:error) */
+	const char* src,		/* Pointer to the input string */
+	unsigned char* dst		/* Pointer to the output buffer (must be 45 byte at least) */
+)
+{
+	const unsigned char *s = (const unsigned char*)src;
+	unsigned char b1, b2, b3, b4;
+	int bc, cc;
+
+
+	b1 = UuDec[*s++];
+	if (b1 & 0x80) return -1;
+	bc = b1;
+
+	for (cc = bc; cc >= 3; cc -= 3, s += 4) {	/* Full groups */
+		b1 = UuDec[s[0]]; b2 = UuDec[s[1]]; b3 = UuDec[s[2]]; b4 = UuDec[s[3]];
+		if ((b1 | b2 | b3 | b4) & 0x80) return -1;
+		*dst++ = (b1 << 2) | (b2 >> 4);
+		*dst++ = (b2 << 4) | (b3 >> 2);
+		*dst++ = (b3 << 6) | b4;
+	}
+	if (cc > 0) {	/* Last partial group */
+		b1 = UuDec[s[0]];
+		if (b1 & 0x80) return -1;
+		b2 = UuDec[s[1]];
+		if (b2 & 0x80) return -1;
+		*dst++ = (b1 << 2) | (b2 >> 4);
+		if (cc >= 2) {
+			b3 = UuDec[s[2]];
+			if (b3 & 0x80) return -1;
+			*dst++ = (b2 << 4) | (b3 >> 2);
+		}
+	}
+
+	return bc;
+}
+
+
+
+/* Create CRC32 sum (bitwise, reference of the fast implementations) */
+static
+uint32_t crc32_bit (
+	const uint8_t* src,
+	unsigned int cnt
+)
+{
+	uint32_t r, n;
+
+
+	r = 0xFFFFFFFF;
+    do {
+		r ^= *src++;
+		for (n = 0; n < 8; n++) {
+			r = r & 1 ? r >> 1 ^ 0xEDB88320 : r >> 1;
+		}
+	} while (--cnt);
+    return ~r;
+}
+
+
+static uint32_t CrcTbl[8][256];	/* Tables for slicing-by-8 */
+static int CrcFold;				/* Use PCLMULQDQ folding */
+
+
+/* Update CRC32 register with slicing-by-8 */
+static
+uint32_t crc32_sb8 (
+	uint32_t r,			/* CRC register */
+	const uint8_t* src,
+	unsigned int cnt
+)
+{
+	uint32_t w0, w1;
+
+
+	for ( ; cnt >= 8; cnt -= 8, src += 8) {
+		w0 = LD_DWORD(src) ^ r;
+		w1 = LD_DWORD(src + 4);
+		r = CrcTbl[7][w0 & 0xFF] ^ CrcTbl[6][(w0 >> 8) & 0xFF] ^ CrcTbl[5][(w0 >> 16) & 0xFF] ^ CrcTbl[4][w0 >> 24]
+		  ^ CrcTbl[3][w1 & 0xFF] ^ CrcTbl[2][(w1 >> 8) & 0xFF] ^ CrcTbl[1][(w1 >> 16) & 0xFF] ^ CrcTbl[0][w1 >> 24];
+	}
+	while (cnt--) {
+		r = (r >> 8) ^ CrcTbl[0][(r ^ *src++) & 0xFF];
+	}
+	return r;
+}
+
+
+#ifdef USE_X86_SIMD
+/* Update CRC32 register with folding by carry-less multiply (cnt must be a multiple of 16 and 64 or larger) */
+__attribute__((target("pclmul,sse4.1")))
+static
+uint32_t crc32_clmul (
+	uint32_t r,			/* CRC register */
+	const uint8_t* src,
+	unsigned int cnt
+)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+
+	/* Fold 512 bits at a time */
+	x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)src), _mm_cvtsi32_si128(r));
+	x2 = _mm_loadu_si128((const __m128i*)(src + 16));
+	x3 = _mm_loadu_si128((const __m128i*)(src + 32));
+	x4 = _mm_loadu_si128((const __m128i*)(src + 48));
+	x0 = _mm_load_si128((const __m128i*)k1k2);
+	for (src += 64, cnt -= 64; cnt >= 64; src += 64, cnt -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)src));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(src + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(src + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(src + 48)));
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i*)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x4), x5);
+	for ( ; cnt >= 16; src += 16, cnt -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), _mm_loadu_si128((const __m128i*)src)), x5);
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00), x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+
+/* Create CRC32 sum */
+static
+uint32_t crc32 (
+	const uint8_t* src,
+	unsigned int cnt
+)
+{
+	uint32_t r = 0xFFFFFFFF;
+
+
+#ifdef USE_X86_SIMD
+	if (CrcFold && cnt >= 64) {	/* Process the 16-byte blocks by folding and the rest by tables */
+		r = crc32_clmul(r, src, cnt & ~15);
+		src += cnt & ~15;
+		cnt &= 15;
+	}
+#endif
+	return ~crc32_sb8(r, src, cnt);
+}
+
+/* Initialize CRC32 engine (create tables and select the fastest implementation) */
+static
+void init_crc (void)
+{
+	uint32_t r, i, n;
+	uint8_t pat[1000];
+
+
+	for (i = 0; i < 256; i++) {
+		r = i;
+		for (n = 0; n < 8; n++) {
+			r = r & 1 ? r >> 1 ^ 0xEDB88320 : r >> 1;
+		}
+		CrcTbl[0][i] = r;
+	}
+	for (i = 0; i < 256; i++) {
+		for (n = 1; n < 8; n++) {
+			CrcTbl[n][i] = (CrcTbl[n - 1][i] >> 8) ^ CrcTbl[0][CrcTbl[n - 1][i] & 0xFF];
+		}
+	}
+#ifdef USE_X86_SIMD
+	CrcFold = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+	/* Check the fast implementations against the reference */
+	for (i = 0, r = 1; i < sizeof pat; i++) {
+		r = r * 1103515245 + 12345;
+		pat[i] = (uint8_t)(r >> 16);
+	}
+	for (i = 1; i <= sizeof pat; i += 37) {
+		if (crc32(pat, i) != crc32_bit(pat, i)) break;
+	}
+	if (i <= sizeof pat) CrcFold = 0;
+}
+
+
+/* Fill the receive buffer with all data available (wait for data if no data) */
+static
+int fill_rxbuf (	/* 0:timeout or error, >0:number of bytes received */
+	SESSION* ses
+)
+{
+	fd_set rfds;
+	struct timeval tv;
+	int ready, rc;
+
+	for (;;) {
+		FD_ZERO(&rfds);
+		FD_SET(ses->Com, &rfds);
+
+		tv = ses->Timeout;	/* select() may update the timeout value */
+		ready = select(ses->Com + 1, &rfds, NULL, NULL, &tv);
+		if (ready == 0) {
+			return 0;
+		} else if (ready == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			} else {
+				ses->ComLost = 1;
+				return 0;
+			}
+		}
+
+		rc = read(ses->Com, ses->Rx, sizeof ses->Rx);
+		if (rc <= 0) {
+			if (rc < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+			ses->ComLost = 1;	/* Readable with no data or EIO: the port is hung up (e.g. USB adapter unplugged) */
+			return 0;
+		}
+		ses->RxPtr = 0;
+		ses->RxCnt = rc;
+		ses->WireCnt += rc;
+		return rc;
+	}
+}
+
+/* Discard the data in the receive buffer and the port */
+static
+void flush_rxbuf (
+	SESSION* ses
+)
+{
+	tcflush(ses->Com, TCIOFLUSH);
+	ses->RxPtr = ses->RxCnt = 0;
+}
+
+static 
+int receive_serial (
+	SESSION* ses,
+	void *buff,
+	int bufsize
+)
+{
+	int len = 0, n;
+	char *p = buff;
+
+	while (len < bufsize) {
+		if (ses->RxPtr >= ses->RxCnt && !fill_rxbuf(ses)) return 0;
+		n = ses->RxCnt - ses->RxPtr;
+		if (n > bufsize - len) n = bufsize - len;
+		memcpy(p, &ses->Rx[ses->RxPtr], n);
+		ses->RxPtr += n;
+		p += n;
+		len += n;
+	}
+	return len;
+}
+
+/* Send the data in the transmit queue followed by a data block in a writev() */
+/* Short writes are retried until all data is sent and it waits for the port to be writable on EAGAIN */
+static
+int send_data (	/* 0:succeeded, 1:failed */
+	SESSION* ses,
+	const void* data,	/* Data block to be sent after the queued data (NULL:no data block) */
+	uint32_t size		/* Size of the data block */
+)
+{
+	struct iovec iov[2];
+	struct pollfd pfd;
+	int n = 0, i = 0;
+	ssize_t rc;
+
+
+	if (ses->TxLen) {
+		iov[n].iov_base = ses->Tx;
+		iov[n++].iov_len = ses->TxLen;
+	}
+	if (size) {
+		iov[n].iov_base = (void*)data;
+		iov[n++].iov_len = size;
+	}
+	ses->TxLen = 0;
+
+	while (i < n) {
+		rc = writev(ses->Com, &iov[i], n - i);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) {
+				ses->ComLost = 1;	/* EIO: the port is hung up */
+				return 1;
+			}
+			pfd.fd = ses->Com;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, ses->Timeout.tv_sec * 1000 + ses->Timeout.tv_usec / 1000) <= 0) return 1;
+			if (pfd.revents & (POLLHUP | POLLERR)) {
+				ses->ComLost = 1;
+				return 1;
+			}
+			continue;
+		}
+		ses->WireCnt += rc;
+		while (i < n && (size_t)rc >= iov[i].iov_len) {	/* Skip the segments sent */
+			rc -= iov[i++].iov_len;
+		}
+		if (i < n) {	/* Short write */
+			iov[i].iov_base = (uint8_t*)iov[i].iov_base + rc;
+			iov[i].iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/* Send a command line and start to measure its round trip time */
+static
+int send_cmd (	/* 0:succeeded, 1:failed */
+	SESSION* ses,
+	const char* cmd		/* Command line (the first character is the command) */
+)
+{
+	int rc;
+
+
+	rc = send_data(ses, cmd, strlen(cmd));
+	ses->RttCmd = cmd[0];
+	ses->RttStart = get_time();
+	return rc;
+}
+
+/* Put a string into the transmit queue (sent at next send_data) */
+static
+int put_tx (	/* 0:succeeded, 1:failed to flush the queue */
+	SESSION* ses,
+	const char* str
+)
+{
+	uint32_t len = strlen(str);
+
+
+	if (ses->TxLen + len > sizeof ses->Tx && send_data(ses, NULL, 0)) return 1;
+	memcpy(&ses->Tx[ses->TxLen], str, len);
+	ses->TxLen += len;
+	return 0;
+}
+
+/* Get a line from the device */
+static
+int rcvr_line (
+	// HANDLE com,
+	SESSION* ses,
+	char* buff,
+	int bufsize
+)
+{
+	int rc, i = 0;
+
+
+	for (;;) {
+		// ReadFile(com, &buff[i], 1, &rc, NULL);	/* Get a character */
+		if (ses->RxPtr >= ses->RxCnt) {	/* Read all data available if the buffer is empty */
+			rc = fill_rxbuf(ses);
+			if (rc == 0) {	/* I/O error? */
+				ses->RttCmd = 0;
+				i = 0; break;
+			}
+		}
+		buff[i] = ses->Rx[ses->RxPtr++];
+		if (buff[i] == '\n') {				/* EOL? */
+			if (ses->RttCmd) {	/* First response line of the command */
+				add_rtt(ses, ses->RttCmd, get_time() - ses->RttStart);
+				ses->RttCmd = 0;
+			}
+			break;
+		}
+		if ((uint8_t)buff[i] < 0x20) continue;	/* Ignore invisible chars */
+		i++;
+		if (i >= bufsize - 1) {				/* Buffer overflow? */
+			i = 0; break;
+		}
+	}
+	buff[i] = 0;	/* Remove \n */
+	return i;
+}
+
+/* Send the queued commands in a burst and check their return codes */
+static
+int flush_cmds (	/* 0:all succeeded, command character:the first command failed */
+	SESSION* ses
+)
+{
+	int i, fc = 0;
+	double t;
+
+
+	if (!ses->QueNum) return 0;
+	t = get_time();
+	if (send_data(ses, ses->Que, ses->QueLen)) {
+		fc = ses->QueCmd[0];
+		ses->Res[0] = 0;
+	}
+	for (i = 0; i < ses->QueNum && !fc; i++) {	/* Match the responses in order of the commands */
+		if (rcvr_line(ses, ses->Res, sizeof ses->Res)) add_rtt(ses, ses->QueCmd[i], get_time() - t);
+		if (!ses->Res[0] || strcmp(ses->Res, "0")) {
+			fc = ses->QueCmd[i];
+			/* Commands following the failed one have been sent, discard their responses */
+			while (++i < ses->QueNum && rcvr_line(ses, ses->Que, sizeof ses->Que)) ;
+		}
+	}
+	ses->Cmds += ses->QueNum;
+	ses->CmdTime += get_time() - t;
+	ses->QueLen = ses->QueNum = 0;
+	ses->QueTail = -1;
+
+	return fc;
+}
+
+
+/* Put a command into the command queue */
+/* The queued commands are sent at once in flush_cmds() with no wait for each response. Only
+   RX_FIFO bytes can be put after a long-running command (C or E) because the device does not read
+   the UART until end of the command. The queue is flushed when no more command can be queued. */
+static
+int queue_cmd (	/* 0:queued, command character:a command failed in the flush */
+	SESSION* ses,
+	const char* fmt,
+	...
+)
+{
+	va_list ap;
+	char buf[80];
+	int len, fc = 0;
+
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof buf - 2, fmt, ap);
+	va_end(ap);
+	strcat(buf, ses->Del);
+	len += strlen(ses->Del);
+
+	if (ses->QueNum >= MAX_QUEUE || ses->QueLen + len > sizeof ses->Que
+		|| (ses->QueTail >= 0 && ses->QueTail + len > RX_FIFO)) {
+		fc = flush_cmds(ses);	/* Flush the queue if the command cannot be put */
+		if (fc) return fc;		/* Cancel the command on error */
+	}
+	memcpy(&ses->Que[ses->QueLen], buf, len);
+	ses->QueLen += len;
+	ses->QueCmd[ses->QueNum++] = buf[0];
+	if (buf[0] == 'C' || buf[0] == 'E') {
+		ses->QueTail = 0;
+	} else if (ses->QueTail >= 0) {
+		ses->QueTail += len;
+	}
+
+	return 0;
+}
+
+
+
+/* Control the RTS and DTR pins */
+static int ctrl_pin (int fd, pinfunc_t f)
+{
+	int flag;
+	switch (f) {
+		case CLRDTR:
+			flag = TIOCM_DTR;
+			return ioctl(fd, TIOCMBIC, &flag);
+		case CLRRTS:
+			flag = TIOCM_RTS;
+			return ioctl(fd, TIOCMBIC, &flag);
+		case SETDTR:
+			flag = TIOCM_DTR;
+			return ioctl(fd, TIOCMBIS, &flag);
+		case SETRTS:
+			flag = TIOCM_RTS;
+			return ioctl(fd, TIOCMBIS, &flag);
+	}
+}
+
+
+
+speed_t get_baud (int baud)
+{
+	switch (baud) {
+		case 1200:
+			return B1200;
+		case 1800:
+			return B1800;
+		case 2400:
+			return B2400;
+		case 4800:
+			return B4800;
+		case 9600:
+			return B9600;
+		case 19200:
+			return B19200;
+		case 38400:
+			return B38400;
+#ifdef B7200
+		case 7200:
+			return B7200;
+#endif
+#ifdef B14400
+		case 14400:
+			return B14400;
+#endif
+#ifdef B28800
+		case 28800:
+			return B28800;
+#endif
+#ifdef B57600
+		case 57600:
+			return B57600;
+#endif
+#ifdef B76800
+    	case 76800:
+			return B76800;
+#endif
+#ifdef B115200
+		case 115200:
+			return B115200;
+#endif
+#ifdef B230400
+		case 230400:
+			return B230400;
+#endif
+		default:
+			fprintf(stderr, "Not defined baud rate: %d\n", baud);
+			return (speed_t)baud;
+	}
+}
+
+
+
+/* Restore the port settings and close the port */
+static
+void close_port (
+	SESSION* ses
+)
+{
+	if (ses->Com >= 0) {
+		tcsetattr(ses->Com, TCSANOW, &ses->OldTio);
+		close(ses->Com);
+	}
+	ses->Com = -1;
+	ses->ComLost = 0;
+}
+
+
+
+static
+int enter_ispmode (
+	SESSION* ses
+)
+{
+	// DCB dcb = { sizeof(DCB),
+	// 			Baud, TRUE, FALSE, FALSE, FALSE,
+	// 			DTR_CONTROL_DISABLE, FALSE,
+	// 			TRUE, FALSE, FALSE, FALSE, FALSE,
+	// 			RTS_CONTROL_DISABLE, FALSE, 0, 0,
+	// 			10, 10,
+	// 			8, NOPARITY, ONESTOPBIT, '\x11', '\x13', '\xFF', '\xFF', 0 };
+	// COMMTIMEOUTS ct1 = { 0, 1, 50, 1, 50},
+	// 			 ct2 = { 0, 1, 500, 1, 500};
+	ses->Tio.c_cflag |= CREAD;          // 受信有効
+    ses->Tio.c_cflag |= CLOCAL;         // ローカルライン（モデム制御なし）
+    ses->Tio.c_cflag |= CS8;            // データビット:8bit
+    ses->Tio.c_cflag |= 0;              // ストップビット:1bit
+    ses->Tio.c_cflag |= 0;              // パリティ:None
+
+	char str[20];
+	// HANDLE h;
+	int h;
+	uint32_t wc, n, m, iv, wait = 0;
+	int rc = 0, rd, cr;
+	double t0, t = 0;
+
+
+	/* Open communication port (it is left open in daemon mode) */
+	if (ses->Com < 0) {
+		// sprintf(str, "\\\\.\\COM%u", Port);
+		// *com = h = CreateFile(str, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		ses->Com = h = open(ses->Port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		// if (h == INVALID_HANDLE_VALUE) {
+		if (h < 0) {
+			// fprintf(stderr, "%s could not be opened.\n", str);
+			put_mess(ses, "%s could not be opened.\n", ses->Port);
+			return 5;
+		}
+		tcgetattr(h, &ses->OldTio); /* Save current port settings */
+		// SetCommState(h, &dcb);		/* Set serial bit rate */
+		cfsetspeed(&ses->Tio, get_baud(Baud)); /* Set serial bit rate */
+		cfmakeraw(&ses->Tio); /* Set the LAW mode */
+		tcsetattr(h, TCSANOW, &ses->Tio); /* Reflect settings */
+	}
+	h = ses->Com;
+	// SetCommTimeouts(h, &ct1);	/* Set processing timeout of 200m sec */
+	ses->Timeout.tv_sec = 0;
+	ses->Timeout.tv_usec = 200 * 1000; /* Set processing timeout of 200m sec */
+	// EscapeCommFunction(h, (Pol & 2) ? SETRTS : CLRRTS);	/* Set BOOT pin low if RTS controls it */
+	ctrl_pin(h, (Pol & 2) ? SETRTS : CLRRTS); /* Set BOOT pin low if RTS controls it */
+
+	put_mess(ses, "Entering ISP mode.");
+	cr = ses->SyncSign ? ses->SyncCr : 1;	/* Line ending to be tried first */
+	for (n = 2; n; n--) {
+		/* Reset the device if DTR signal controls RESET pin */
+		// EscapeCommFunction(h, (Pol & 1) ? SETDTR : CLRDTR);
+		ctrl_pin(h, (Pol & 1) ? SETDTR : CLRDTR);
+		// Sleep(50);
+		usleep(50000);
+		// EscapeCommFunction(h, (Pol & 1) ? SETDTR : CLRDTR);
+		ctrl_pin(h, (Pol & 1) ? CLRDTR : SETDTR);
+		t0 = get_time();
+		if (ses->SyncSign) usleep(ses->SyncWait * 750);	/* Skip most of the boot time learned on this port */
+
+		/* Send '?' at growing interval until the device responds */
+		flush_rxbuf(ses);
+		for (iv = 10 + 20000 / Baud, m = 0; !m && !ses->ComLost && get_time() - t0 < SYNC_TIME; ) {
+			// WriteFile(h, "?", 1, &wc, NULL);
+			t = get_time();
+			send_cmd(ses, "?");
+			ses->SyncTry++;
+			ses->Timeout.tv_usec = iv * 1000;
+			rd = fill_rxbuf(ses);	/* React to the first byte received */
+			ses->Timeout.tv_usec = 200 * 1000;
+			if (!rd) {	/* No response, retry at longer interval */
+				iv = (iv * 3 / 2 < 100) ? iv * 3 / 2 : 100;
+				continue;
+			}
+			if (rcvr_line(ses, str, sizeof str) && !strcmp(str, "Synchronized")) {
+				ses->Del = cr ? "\r\n" : "\n";
+				sprintf(str, "Synchronized%s", ses->Del);
+				// WriteFile(h, str, strlen(str), &wc, NULL);
+				send_data(ses, str, strlen(str));
+				rcvr_line(ses, str, sizeof str);
+				if (rcvr_line(ses, str, sizeof str) && !strcmp(str, "OK")) {
+					m = 1;
+					break;
+				}
+				cr ^= 1;	/* The device restarts auto-baud, try the other line ending */
+			}
+			// PurgeComm(h, PURGE_RXABORT|PURGE_RXCLEAR);
+			flush_rxbuf(ses);	/* Discard the garbage */
+		}
+		if (m) break;
+		if (ses->ComLost) {	/* No use to try on the port hung up */
+			n = 0;
+			break;
+		}
+	}
+	wait = (uint32_t)((t - t0) * 1000);	/* Time from the reset to the successful sync request */
+	if (n) {
+		sprintf(str, "%u%s", Freq, ses->Del);
+		// WriteFile(h, str, strlen(str), &wc, NULL);
+		send_data(ses, str, strlen(str));
+		rcvr_line(ses, str, sizeof str);
+		if (!rcvr_line(ses, str, sizeof str) || strcmp(str, "OK")) n = 0;
+	}
+	if (!n) {
+		put_mess(ses, "failed to sync.\n");
+		rc = 6;
+	}
+	if (!rc) {
+		put_mess(ses, ".");
+		sprintf(str, "A 0%s", ses->Del);
+		// WriteFile(h, str, strlen(str), &wc, NULL);	/* Echo Off */
+		send_cmd(ses, str);
+		rcvr_line(ses, str, sizeof str);
+		if (!rcvr_line(ses, str, sizeof str) || strcmp(str, "0")) {
+			put_mess(ses, "failed(A).\n");
+			rc = 6;
+		}
+	}
+	if (!rc) {
+		put_mess(ses, ".");
+		sprintf(str, "J%s", ses->Del);
+		// WriteFile(h, str, strlen(str), &wc, NULL);	/* Get device ID */
+		send_cmd(ses, str);
+		if (!rcvr_line(ses, str, sizeof str) || strcmp(str, "0")) {
+			put_mess(ses, "failed(J).\n");
+			rc = 6;
+		} else {
+			/* Find target device type by device ID */
+			rcvr_line(ses, str, sizeof str);
+			wc = atol(str);
+			for (ses->Device = DevLst; ses->Device->Sign != wc && ses->Device->Sign; ses->Device++) ;
+			if (!ses->Device->Sign) {
+				put_mess(ses, " unknown device (%u).", wc);
+				rc = 6;
+			}
+		}
+	}
+	if (!rc) {	/* Get device serial number (not available on some devices) */
+		sprintf(str, "N%s", ses->Del);
+		send_cmd(ses, str);
+		if (rcvr_line(ses, str, sizeof str) && !strcmp(str, "0")) {
+			for (m = 0; m < 4 && rcvr_line(ses, str, sizeof str); m++) ses->Uid[m] = strtoul(str, NULL, 10);
+			ses->HasUid = (m == 4);
+		}
+	}
+	if (!rc) {
+		put_mess(ses, ".");
+		sprintf(str, "U 23130%s", ses->Del);	/* Unlock */
+		// WriteFile(h, str, strlen(str), &wc, NULL);
+		send_cmd(ses, str);
+		if (!rcvr_line(ses, str, sizeof str) || strcmp(str, "0")) {
+			put_mess(ses, "failed(U).\n");
+			rc = 6;
+		}
+	}
+	if (!rc) {
+		put_mess(ses, "passed.\nDetected device is LPC%s (%uK).\n", ses->Device->DeviceName, ses->Device->FlashSize / 1024);
+		ses->SyncSign = ses->Device->Sign;	/* Learn the sync parameters for the next board on this port */
+		ses->SyncWait = wait;
+		ses->SyncCr = cr;
+		// SetCommTimeouts(h, &ct2);	/* Set processing timeout of 500m sec */
+		ses->Timeout.tv_sec = 0;
+		ses->Timeout.tv_usec = 500 * 1000;
+	}
+	if (rc) close_port(ses);	/* The port is opened again by the next job in daemon mode (it may have been replaced) */
+
+	return rc;
+}
+
+
+
+static
+void exit_ispmode (
+	// HANDLE com
+	SESSION* ses
+)
+{
+	/* Apply a reset to the device if DTR/RTS controls RESET/BOOT pin */
+	// EscapeCommFunction(com, (Pol & 2) ? CLRRTS : SETRTS);	/* Set BOOT pin high */
+	ctrl_pin(ses->Com, (Pol & 2) ? CLRRTS : SETRTS);	/* Set BOOT pin high */
+	// EscapeCommFunction(com, (Pol & 1) ? SETDTR : CLRDTR);	/* Set RESET pin low */
+	ctrl_pin(ses->Com, (Pol & 1) ? SETDTR : CLRDTR);	/* Set RESET pin low */
+	// Sleep(50);
+	usleep(50000);
+	// EscapeCommFunction(com, (Pol & 1) ? CLRDTR : SETDTR);	/* Set RESET pin high */
+	ctrl_pin(ses->Com, (Pol & 1) ? CLRDTR : SETDTR);	/* Set RESET pin high */
+
+	if (!ServeSock[0] || ses->ComLost) {	/* The port is kept open for the next job in daemon mode unless it has been lost */
+		close_port(ses);
+	}
+}
+
+
+
+
+/* Put the UART registers of the device into the parameters of the flash read/write code */
+static
+void set_uart (
+	uint8_t* code,			/* Code with the UART parameters at offset 12-39 */
+	const DEVICE* dev
+)
+{
+	ST_DWORD(&code[12], LD_DWORD(&dev->Code[80]));	/* UART base address */
+	if (dev->Code == Code800 || dev->Code == Code1500) {	/* USART (STAT, RXDAT and TXDAT) */
+		ST_DWORD(&code[16], 0x08); ST_DWORD(&code[20], 0x01); ST_DWORD(&code[24], 0x14);
+		ST_DWORD(&code[28], 0x08); ST_DWORD(&code[32], 0x04); ST_DWORD(&code[36], 0x1C);
+	} else {	/* 16550 compatible UART (LSR, RBR and THR) */
+		ST_DWORD(&code[16], 0x14); ST_DWORD(&code[20], 0x01); ST_DWORD(&code[24], 0x00);
+		ST_DWORD(&code[28], 0x14); ST_DWORD(&code[32], 0x20); ST_DWORD(&code[36], 0x00);
+	}
+}
+
+
+/* Download a code to the data write buffer and execute it */
+static
+int exec_code (	/* 0:succeeded, 1:failed */
+	SESSION* ses,
+	const uint8_t* code,
+	uint32_t csz
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t xc, cc, sum, d;
+	char buf[80];
+
+
+	sprintf(buf, "W %u %u%s", dev->XferAddr, csz, ses->Del);
+	// WriteFile(com, buf, strlen(buf), &bx, NULL);
+	put_tx(ses, buf);
+	if (dev->RawMode) {
+		// WriteFile(com, Device->Code, SZ_CODE, &bx, NULL);
+		send_data(ses, code, csz);
+	} else {
+		for (xc = sum = 0; xc < csz; xc += cc) {
+			cc = (xc + 45 <= csz) ? 45 : csz - xc;
+			uuencode(&code[xc], cc, buf);
+			strcat(buf, "\r\n");
+			// WriteFile(com, buf, strlen(buf), &bx, NULL);
+			put_tx(ses, buf);
+			for (d = 0; d < cc; d++) sum += code[xc + d];
+		}
+		sprintf(buf, "%u\r\n", sum);
+		// WriteFile(com, buf, strlen(buf), &bx, NULL);
+		put_tx(ses, buf);
+		send_data(ses, NULL, 0);
+	}
+	ses->RttCmd = 'W'; ses->RttStart = get_time();
+	if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0")) {
+		put_mess(ses, "failed(W,%s).\n", buf);
+		return 1;
+	}
+	if (!dev->RawMode) {
+		if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "OK")) {
+			put_mess(ses, "failed(%s).\n", buf);
+			return 1;
+		}
+	}
+
+	/* Execute the loaded code */
+	sprintf(buf, "G %u T%s", dev->XferAddr, ses->Del);
+	// WriteFile(com, buf, strlen(buf), &bx, NULL);
+	send_cmd(ses, buf);
+	if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0")) {
+		put_mess(ses, "failed(G,%s).\n", buf);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Get the IAP parameters of the device for the flash write code */
+static
+void iap_param (
+	const DEVICE* dev,
+	uint32_t* entry,	/* IAP entry address (Thumb) */
+	uint32_t* cclk		/* CPU clock frequency in ISP mode [kHz] */
+)
+{
+	const char *dn = dev->DeviceName;
+
+
+	if (dev->Code == Code2000) {	/* LPC21xx/22xx run on the oscillator, LPC23xx/24xx run on the 4MHz IRC */
+		*entry = 0x7FFFFFF1;
+		*cclk = (dn[1] == '1' || dn[1] == '2') ? Freq : 4000;
+	} else if (dev->Code == Code1500) {
+		*entry = 0x03000205;
+		*cclk = 12000;
+	} else if (dn[0] == '8' && (dn[1] == '0' || dn[1] == '4')) {	/* LPC80x/84x have the boot ROM at 0x0F000000 and run on the 12MHz FRO */
+		*entry = 0x0F001FF1;
+		*cclk = 12000;
+	} else {	/* LPC8xx/11xx/12xx/13xx/17xx/40xx (LPC175x/176x run on the 4MHz IRC) */
+		*entry = 0x1FFF1FF1;
+		*cclk = (!strncmp(dn, "175", 3) || !strncmp(dn, "176", 3)) ? 4000 : 12000;
+	}
+}
+
+
+/* Issue a command to the flash write code and get its reply */
+/* A frame rejected due to CRC error is sent again */
+static
+int stub_cmd (	/* Status (0:succeeded, 1-:IAP status or rejected, -1:timeout) */
+	SESSION* ses,
+	uint32_t cmd,		/* 1:erase sectors arg1-arg2, 2:load data into buffer offset arg4 and write, 3:CRC of arg1 (size arg2), 4:write without data, 5:load packed data and write */
+	uint32_t arg1,		/* Sector, flash address (write) or start address (CRC) */
+	uint32_t arg2,		/* Sector or size */
+	uint32_t arg3,		/* Sector to be prepared (write) */
+	uint32_t arg4,		/* Buffer offset of the data (write) */
+	const uint8_t* data,	/* Data to be sent (cmd 2, 5) */
+	uint32_t size,			/* Size of the data to be sent (arg2 on cmd 2, less than arg2 on cmd 5) */
+	uint32_t* val			/* Value returned (cmd 3) */
+)
+{
+	uint8_t frm[20 + 4096 + 4], rep[8];
+	uint32_t n, st;
+	int retry;
+
+
+	ST_DWORD(&frm[0], cmd); ST_DWORD(&frm[4], arg1); ST_DWORD(&frm[8], arg2); ST_DWORD(&frm[12], arg3); ST_DWORD(&frm[16], arg4);
+	n = 20;
+	if (data) {
+		memcpy(&frm[n], data, size);
+		n += size;
+	}
+	st = crc32(frm, n);
+	ST_DWORD(&frm[n], st);
+	n += 4;
+
+	for (retry = 0; ; retry++) {
+		ses->Timeout.tv_sec = 2 + n * 10 / Baud;	/* Frame may still be on the wire and the CRC takes a while */
+		if (cmd == 1) ses->Timeout.tv_sec += arg2 - arg1 + 1;	/* Erase takes a while per sector */
+		if (send_data(ses, frm, n) || receive_serial(ses, rep, 8) < 8) {
+			ses->Timeout.tv_sec = 0;
+			return -1;
+		}
+		ses->Timeout.tv_sec = 0;
+		st = LD_DWORD(&rep[0]);
+		if (st != 0x100 || retry >= WRITE_RETRY) break;
+		ses->Resend++;
+	}
+	if (val) *val = LD_DWORD(&rep[4]);
+	return (int)st;
+}
+
+
+
+/* Get number of block slots in the data buffer of the flash write code */
+static
+uint32_t stub_slots (
+	SESSION* ses
+)
+{
+	uint32_t ns;
+
+
+	ns = (ses->BuffSize - WRITE_AREA) / ses->FrameSize;
+	if (ns > sizeof ses->Blk / ses->FrameSize) ns = sizeof ses->Blk / ses->FrameSize;
+	return ns;
+}
+
+
+
+/* Download the flash write code and execute it (ISP commands are not available after this) */
+static
+int start_stub (	/* 0:succeeded, 1:failed */
+	SESSION* ses
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint8_t stub[SZ_WRITE];
+	uint32_t entry, cclk;
+
+
+	memcpy(stub, CodeWrite, SZ_WRITE);
+	set_uart(stub, dev);
+	iap_param(dev, &entry, &cclk);
+	ST_DWORD(&stub[40], entry);		/* IAP entry */
+	ST_DWORD(&stub[44], cclk);		/* CPU clock frequency */
+	ST_DWORD(&stub[48], dev->XferAddr + WRITE_AREA);	/* Data buffer */
+	ST_DWORD(&stub[52], stub_slots(ses) * ses->FrameSize);	/* Data buffer size */
+	ST_DWORD(&stub[56], ses->FrameSize);	/* Maximum data length of a frame */
+	if (exec_code(ses, stub, SZ_WRITE)) return 1;
+	ses->StubRun = 1;
+	return 0;
+}
+
+
+
+static
+int read_flash (
+	// HANDLE com,
+	SESSION* ses,
+	uint8_t* buffer,		/* Buffer to store the flash memory data (rounded up to READ_BLOCK) */
+	uint32_t start,			/* Start address of the area to read */
+	uint32_t end			/* End address of the area to read (not included) */
+)
+{
+	const DEVICE *dev = ses->Device;
+	const uint8_t *code;
+	uint8_t stub[SZ_READ], req[READ_DEPTH], hdr[4];
+	uint32_t addr, ra, sa, ea, cc, d, bx, csz, bs;
+	uint16_t dsum;
+	int i;
+
+
+	put_mess(ses, "Reading.");
+
+	/* Use the streaming read code if the buffer can hold it, or the legacy read code */
+	if (ses->BuffSize >= SZ_READ) {
+		memcpy(stub, CodeRead, SZ_READ);
+		ST_DWORD(&stub[4], LD_DWORD(&dev->Code[76]));	/* Remap register */
+		ST_DWORD(&stub[8], dev->Code[2]);				/* Value to disable remapping */
+		set_uart(stub, dev);
+		for (bs = READ_BLOCK; bs > 1024 && dev->FlashSize % bs; bs >>= 1) ;
+		sa = start / bs * bs;
+		ST_DWORD(&stub[40], sa);	/* Start address */
+		ST_DWORD(&stub[44], bs);	/* Block size */
+		code = stub; csz = SZ_READ;
+	} else {	/* The legacy code always reads from address 0 */
+		code = dev->Code; csz = SZ_CODE; bs = 1024; sa = 0;
+	}
+	ea = (end + bs - 1) / bs * bs;	/* End of the read area */
+
+	/* Download user code to read flash with remapping disabled and execute it */
+	if (exec_code(ses, code, csz)) return 10;
+
+	/* Receive flash memory data and store it to the buffer */
+	/* Next blocks are requested before the current block arrives to keep the line busy */
+	memset(req, 0xAA, sizeof req);
+	for (addr = ra = sa; addr < ea; addr += bs) {
+		for (i = 0; ra < ea && ra < addr + READ_DEPTH * bs; ra += bs, i++) ;
+		// WriteFile(com, &buffer[addr], 1, &bx, NULL);	/* Send a 0xAA to start to transmit a 1KB block */
+		if (i) send_data(ses, req, i);	/* Send 0xAAs to request the blocks */
+		// ReadFile(com, &buffer[addr], 1024, &bx, NULL);	/* Receive a data block */
+		bx = receive_serial(ses, &buffer[addr], bs); /* Receive a data block */
+		// ReadFile(com, &vsum, 2, &bx, NULL);				/* Receive BCC */
+		cc = (code == stub) ? 4 : 2;	/* CRC32 or BCC follows the block */
+		if (bx < bs || receive_serial(ses, hdr, cc) < (int)cc) {
+			put_mess(ses, "timeout.\n");
+			return 11;
+		}
+		if (code == stub) {
+			d = (LD_DWORD(hdr) == crc32(&buffer[addr], bs));
+		} else {
+			for (i = dsum = 0; i < 1024; dsum += buffer[addr + i], i++) ;
+			d = (dsum == (hdr[0] | hdr[1] << 8));
+		}
+		if (!d) {
+			put_mess(ses, "data error.\n");
+			return 11;
+		}
+		if (addr % 0x2000 == 0) put_mess(ses, ".");	/* Display progress indicator at every 8K byte */
+		ses->DataCnt += bs;
+	}
+
+	put_mess(ses, "passed.\n");
+
+	return 0;
+}
+
+
+
+
+/* Find end of the populated flash memory by blank check of the sectors from top down */
+static
+uint32_t used_flash (	/* End address of the highest non-blank sector */
+	SESSION* ses
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t sn;
+	char buf[80];
+
+
+	for (sn = adr2sect(dev, dev->FlashSize - 1) + 1; sn > 0; sn--) {
+		sprintf(buf, "I %u %u%s", sn - 1, sn - 1, ses->Del);
+		send_cmd(ses, buf);
+		if (!rcvr_line(ses, buf, sizeof buf) || (strcmp(buf, "0") && strcmp(buf, "8"))) {
+			return dev->FlashSize;	/* Read entire flash if blank check is not available */
+		}
+		if (!strcmp(buf, "8")) {	/* SECTOR_NOT_BLANK followed by offset and contents */
+			rcvr_line(ses, buf, sizeof buf);
+			rcvr_line(ses, buf, sizeof buf);
+			break;
+		}
+	}
+
+	return sn ? (dev->SectMap[sn] < dev->FlashSize ? dev->SectMap[sn] : dev->FlashSize) : 0;
+}
+
+
+
+/* Get a data block to be written with the check sum of the session applied */
+static
+void load_block (
+	SESSION* ses,
+	uint8_t* dst,			/* Destination in ses->Blk */
+	uint32_t addr,			/* Block address */
+	uint32_t size			/* Block size */
+)
+{
+	uint32_t n;
+
+
+	read_image(addr, dst, size);
+	for (n = addr; n < addr + size && n < sizeof ses->Vect; n++) {
+		dst[n - addr] = ses->Vect[n];
+	}
+}
+
+
+
+/* Send the data block in the session buffer to the data write buffer of the device */
+static
+int send_block (
+	SESSION* ses,
+	uint32_t ofs,		/* Offset in ses->Blk and the data write buffer */
+	uint32_t size		/* Number of bytes to send */
+)
+{
+	const uint8_t *src = &ses->Blk[ofs];
+	uint32_t n, lc, cc, xc, sum;
+	char buf[80], *tp;
+
+
+	/* The write command is sent with the following data in a burst */
+	sprintf(buf, "W %u %u%s", ses->Device->XferAddr + ofs, size, ses->Del);
+	// WriteFile(com, buf, strlen(buf), &n, NULL);
+	put_tx(ses, buf);
+	if (ses->Device->RawMode) {	/* Raw mode transfer */
+		// WriteFile(com, &buffer[wa], Device->XferSize, &xc, NULL);	/* Send data */
+		if (send_data(ses, src, size)) { /* Send data */
+			put_mess(ses, "failed(W,data).\n");
+			return 1;
+		}
+		ses->RttCmd = 'W'; ses->RttStart = get_time();
+		if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0")) {
+			put_mess(ses, "failed(W,%s).\n", buf);
+			return 1;
+		}
+		/* Check if data has been sent with no error */
+		sprintf(buf, "S %u %u%s", ses->Device->XferAddr + ofs, size, ses->Del);
+		// WriteFile(com, buf, strlen(buf), &n, NULL);
+		send_cmd(ses, buf);
+		ses->Timeout.tv_sec = 1 + size * 10 / Baud;	/* Data may still be on the wire, extend timeout by its transfer time */
+		if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0") ||
+			!rcvr_line(ses, buf, sizeof buf) || strtoul(buf, &tp, 10) != crc32(src, size)
+			) {
+			ses->Timeout.tv_sec = 0;
+			put_mess(ses, "failed(S,%s).\n", buf);
+			return 1;
+		}
+		ses->Timeout.tv_sec = 0;
+	} else {				/* Text mode transfer */
+		for (xc = lc = sum = 0; xc < size; xc += cc) {
+			if (xc + 45 <= size) {
+				cc = 45;
+				lc++;
+			} else {
+				cc = size - xc;
+				lc = 20;
+			}
+			uuencode(&src[xc], cc, buf);
+			strcat(buf, ses->Del);
+			// WriteFile(com, buf, strlen(buf), &n, NULL);
+			put_tx(ses, buf);
+			for (n = 0; n < cc; n++) sum += src[xc + n];
+			if (lc == 20) {	/* Send a group of lines with its check sum */
+				sprintf(buf, "%u%s", sum, ses->Del);
+				// WriteFile(com, buf, strlen(buf), &n, NULL);
+				put_tx(ses, buf);
+				if (send_data(ses, NULL, 0)) {
+					put_mess(ses, "failed(W,data).\n");
+					return 1;
+				}
+				if (xc < 20 * 45) {	/* Response of the write command */
+					ses->RttCmd = 'W'; ses->RttStart = get_time();
+					if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0")) {
+						put_mess(ses, "failed(W,%s).\n", buf);
+						return 1;
+					}
+				}
+				if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "OK")) {
+					put_mess(ses, "failed(%s).\n", buf);
+					return 1;
+				}
+				lc = sum = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+
+
+/* Read a small memory block of the device */
+static
+int read_mem (
+	SESSION* ses,
+	uint32_t addr,		/* Memory address (word aligned) */
+	uint32_t size,		/* Number of bytes to read (multiple of 4, up to 44) */
+	uint8_t* dst
+)
+{
+	uint8_t tmp[64];
+	uint32_t sum, n;
+	char buf[80], *tp;
+
+
+	sprintf(buf, "R %u %u%s", addr, size, ses->Del);
+	send_cmd(ses, buf);
+	if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0")) return 1;
+	if (ses->Device->RawMode) {		/* Raw mode transfer */
+		if (receive_serial(ses, dst, size) < (int)size) return 1;
+	} else {						/* Text mode transfer (a data line and check sum) */
+		if (!rcvr_line(ses, buf, sizeof buf) || uudecode(buf, tmp) != (int)size) return 1;
+		for (sum = n = 0; n < size; n++) sum += tmp[n];
+		if (!rcvr_line(ses, buf, sizeof buf) || strtoul(buf, &tp, 10) != sum) return 1;
+		sprintf(buf, "OK%s", ses->Del);
+		send_data(ses, buf, strlen(buf));
+		memcpy(dst, tmp, size);
+	}
+
+	return 0;
+}
+
+
+
+/* Detect the data write buffer size available in the device RAM */
+static
+void probe_ram (
+	SESSION* ses
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t base, top, sz, cs;
+	uint8_t d[4];
+
+
+	/* Find RAM size by reading the last word of possible RAM size */
+	base = dev->XferAddr & ~0xFFF;
+	for (top = 0, sz = 0x800; sz <= sizeof ses->Blk; sz <<= 1) {
+		if (read_mem(ses, base + sz - 4, 4, d)) break;
+		top = base + sz;
+	}
+
+	/* Data write buffer is from XferAddr to the area used by the boot loader */
+	ses->BuffSize = (top > dev->XferAddr + RAM_RSV) ? (top - RAM_RSV - dev->XferAddr) & ~0xFF : 0;
+
+	/* Copy size is the largest one fits in the buffer and the flash size */
+	for (cs = MAX_COPY(dev); cs > MIN_COPY(dev) && (cs > ses->BuffSize || dev->FlashSize % cs); cs >>= 1) ;
+	if (cs == 2048) cs = 1024;	/* 2048 is not a valid copy size */
+
+	if (ses->BuffSize < dev->XferSize || cs < dev->XferSize) {	/* Use the properties in the table if failed */
+		ses->BuffSize = cs = dev->XferSize;
+	}
+	ses->CopySize = cs;
+	ses->BuffSize -= ses->BuffSize % cs;
+
+	/* Frame size of the flash write code is the largest copy size fits in the buffer following the code */
+	for (cs = ses->CopySize; cs >= MIN_COPY(dev) && (cs == 2048 || WRITE_AREA + cs > ses->BuffSize); cs >>= 1) ;
+	ses->FrameSize = (cs >= MIN_COPY(dev)) ? cs : 0;
+}
+
+
+
+/* Compare a flash memory area with the loaded data */
+/* The device computes CRC of the area if available, or compares it with the data sent to the RAM */
+static
+int comp_flash (	/* 0:matched, 1:mismatched, -1:failed */
+	SESSION* ses,
+	uint32_t sa,		/* Start address (word aligned) */
+	uint32_t ss			/* Size (multiple of 4) */
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t ba, bs, crc;
+	char buf[80], *tp;
+	int diff, st;
+
+
+	if (ses->StubRun) {	/* The flash write code computes CRC of the area */
+		load_block(ses, ses->Blk, sa, ss);
+		st = stub_cmd(ses, 3, sa, ss, 0, 0, NULL, 0, &crc);
+		if (st) {
+			put_mess(ses, st < 0 ? "timeout.\n" : "failed(CRC,%d).\n", st);
+			return -1;
+		}
+		diff = (crc != crc32(ses->Blk, ss));
+	} else if (HAS_CRC(dev)) {	/* Compare CRC of the area with the loaded data */
+		load_block(ses, ses->Blk, sa, ss);
+		sprintf(buf, "S %u %u%s", sa, ss, ses->Del);
+		send_cmd(ses, buf);
+		if (!rcvr_line(ses, buf, sizeof buf) || strcmp(buf, "0") || !rcvr_line(ses, buf, sizeof buf)) {
+			put_mess(ses, "failed(S,%s).\n", buf);
+			return -1;
+		}
+		diff = (strtoul(buf, &tp, 10) != crc32(ses->Blk, ss));
+	} else {			/* Compare the area with the data sent to the RAM */
+		for (diff = 0, ba = sa; !diff && ba < sa + ss; ba += bs) {
+			bs = sa + ss - ba;
+			if (bs > ses->BuffSize) bs = ses->BuffSize;
+			load_block(ses, ses->Blk, ba, bs);
+			if (send_block(ses, 0, bs)) return -1;
+			sprintf(buf, "M %u %u %u%s", ba, dev->XferAddr, bs, ses->Del);
+			send_cmd(ses, buf);
+			if (!rcvr_line(ses, buf, sizeof buf)) {
+				put_mess(ses, "failed(M).\n");
+				return -1;
+			}
+			if (!strcmp(buf, "10")) {	/* COMPARE_ERROR followed by offset of the mismatch */
+				rcvr_line(ses, buf, sizeof buf);
+				diff = 1;
+			} else if (strcmp(buf, "0")) {
+				put_mess(ses, "failed(M,%s).\n", buf);
+				return -1;
+			}
+		}
+	}
+	ses->DataCnt += ss;
+
+	return diff;
+}
+
+
+
+/* Compare flash memory with the loaded data and select sectors to be updated */
+static
+int diff_flash (
+	SESSION* ses,
+	const uint32_t* crc,	/* CRC32 of the sectors programmed last time (from the UID cache) */
+	uint64_t known			/* Sectors with the CRC32 known (0:no cache, compare all sectors) */
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t ns, ls, sn, sa, ss, n;
+	char buf[80];
+	int diff;
+
+
+	put_mess(ses, "Comparing.");
+
+	/* The sectors are confirmed by CRC of the flash write code if it is to be used (ISP commands are not available after this) */
+	if (USE_STUB(ses) && !ses->StubRun && start_stub(ses)) return 14;
+
+	ns = adr2sect(dev, dev->FlashSize - 1) + 1;	/* Number of sectors */
+	ls = adr2sect(dev, ses->DataEnd);			/* Last sector of the loaded data */
+
+	/* Sector 0 is always updated because its vector area is hidden by the boot ROM in ISP mode */
+	ses->Erase = ses->Write = SECT_BIT(0);
+
+	for (sn = 1; sn <= ls; sn++) {
+		sa = dev->SectMap[sn];
+		ss = dev->SectMap[sn + 1] - sa;
+		if (!image_used(sa, ss)) continue;	/* Sectors with no data loaded are not touched */
+		if (known & SECT_BIT(sn)) {	/* The sector programmed last time is known */
+			load_block(ses, ses->Blk, sa, ss);
+			if (crc32(ses->Blk, ss) != crc[sn]) {
+				diff = 1;	/* Changed from the last time, no need to compare */
+			} else {	/* Confirm the whole sector (CRC by the flash write code or read CRC command if available) */
+				diff = comp_flash(ses, sa, ss);
+			}
+		} else if (known && !Diff) {
+			diff = 1;	/* Not known in the cache */
+		} else {
+			diff = comp_flash(ses, sa, ss);
+		}
+		if (diff < 0) return 14;
+		if (diff) {
+			ses->Erase |= SECT_BIT(sn);
+			ses->Write |= SECT_BIT(sn);
+		}
+		if (sn % 4 == 0) put_mess(ses, ".");	/* Display a progress indicator every 4 sectors */
+	}
+
+	/* Sectors above the loaded data must be blank (not touched in update by cache) */
+	if (Diff && ses->StubRun) {	/* Compare with the blank image by the flash write code */
+		for (sn = ls + 1; sn < ns; sn++) {
+			sa = dev->SectMap[sn];
+			diff = comp_flash(ses, sa, dev->SectMap[sn + 1] - sa);
+			if (diff < 0) return 14;
+			if (diff) ses->Erase |= SECT_BIT(sn);
+		}
+	} else if (Diff && ls + 1 < ns) {
+		sprintf(buf, "I %u %u%s", ls + 1, ns - 1, ses->Del);
+		send_cmd(ses, buf);
+		if (!rcvr_line(ses, buf, sizeof buf)) {
+			put_mess(ses, "failed(I).\n");
+			return 14;
+		}
+		if (!strcmp(buf, "8")) {	/* SECTOR_NOT_BLANK followed by offset and contents */
+			rcvr_line(ses, buf, sizeof buf);
+			rcvr_line(ses, buf, sizeof buf);
+			for (sn = ls + 1; sn < ns; sn++) ses->Erase |= SECT_BIT(sn);
+		} else if (strcmp(buf, "0")) {
+			put_mess(ses, "failed(I,%s).\n", buf);
+			return 14;
+		}
+	}
+
+	for (sn = n = 0; sn < ns; sn++) {
+		if (ses->Write & SECT_BIT(sn)) n++;
+	}
+	put_mess(ses, "%u of %u sectors to be updated.\n", n, ls + 1);
+	return 0;
+}
+
+
+
+
+/* Compare the sectors with the loaded data and report mismatched sectors */
+static
+int verify_flash (
+	SESSION* ses,
+	uint64_t sects		/* Sectors to be verified */
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint32_t ls, sn, sa, ss, ea, i, n, fa;
+	uint64_t bad = 0;
+	uint8_t *rbuf;
+	int diff, rc;
+
+
+	put_mess(ses, "Verifying.");
+
+	ls = adr2sect(dev, ses->DataEnd);	/* Last sector of the loaded data */
+	for (sn = n = 0; sn <= ls; sn++) {
+		if (!(sects & SECT_BIT(sn))) continue;
+		sa = dev->SectMap[sn];
+		ss = dev->SectMap[sn + 1] - sa;
+		if (sn == 0) {	/* Vector area of sector 0 is hidden by the boot ROM in ISP mode */
+			sa += 0x200; ss -= 0x200;
+		}
+		diff = comp_flash(ses, sa, ss);
+		if (diff < 0) return 15;
+		if (diff) bad |= SECT_BIT(sn);
+		if (++n % 4 == 0) put_mess(ses, ".");	/* Display a progress indicator every 4 sectors */
+	}
+	if (!bad) {
+		put_mess(ses, "passed.\n");
+		return 0;
+	}
+	put_mess(ses, "failed.\n");
+	for (sn = 0; sn <= ls; sn++) {
+		if (bad & SECT_BIT(sn)) {
+			put_mess(ses, "Sector %u (%05X-%05X) does not match.\n", sn, dev->SectMap[sn], dev->SectMap[sn + 1] - 1);
+		}
+	}
+	if (!(VerifyOpt & 2)) return 15;
+
+	/* Read back the mismatched sectors and show where they differ */
+	for (sn = 0; !(bad & SECT_BIT(sn)); sn++) ;
+	sa = dev->SectMap[sn];
+	for (sn = ls; !(bad & SECT_BIT(sn)); sn--) ;
+	ea = dev->SectMap[sn + 1];
+	rbuf = malloc((dev->FlashSize + READ_BLOCK - 1) & ~(READ_BLOCK - 1));
+	if (!rbuf) return 9;
+	rc = read_flash(ses, rbuf, sa, ea);
+	for (sn = 0; !rc && sn <= ls; sn++) {
+		if (!(bad & SECT_BIT(sn))) continue;
+		sa = dev->SectMap[sn];
+		ss = dev->SectMap[sn + 1] - sa;
+		load_block(ses, ses->Blk, sa, ss);
+		for (i = n = fa = 0; i < ss; i++) {
+			if (rbuf[sa + i] != ses->Blk[i] && !n++) fa = sa + i;
+		}
+		put_mess(ses, "Sector %u: %u bytes differ from %05X.\n", sn, n, fa);
+	}
+	free(rbuf);
+
+	return rc ? rc : 15;
+}
+
+
+
+
+static
+int erase_flash (
+	// HANDLE com
+	SESSION* ses
+)
+{
+	uint32_t ss, es, ns;
+	int fc, st;
+	char buf[80];
+	// COMMTIMEOUTS ct1 = { 0, 1, 2000, 1, 250},
+				//  ct2 = { 0, 1, 500, 1, 500};
+
+
+	put_mess(ses, "Erasing.");
+
+	ns = adr2sect(ses->Device, ses->Device->FlashSize - 1) + 1;	/* Number of sectors */
+
+	/* Exclude the sectors already blank (not on entire erase, not available on the flash write code) */
+	for (ss = 0; ss < ns && !EraseAll && !ses->StubRun; ss++) {
+		if (!(ses->Erase & SECT_BIT(ss))) continue;
+		sprintf(buf, "I %u %u%s", ss, ss, ses->Del);
+		send_cmd(ses, buf);
+		if (!rcvr_line(ses, buf, sizeof buf)) {
+			put_mess(ses, "failed(I).\n");
+			return 12;
+		}
+		if (!strcmp(buf, "0")) {
+			ses->Erase &= ~SECT_BIT(ss);
+		} else if (!strcmp(buf, "8")) {	/* SECTOR_NOT_BLANK followed by offset and contents */
+			rcvr_line(ses, buf, sizeof buf);
+			rcvr_line(ses, buf, sizeof buf);
+		} else {
+			put_mess(ses, "failed(I,%s).\n", buf);
+			return 12;
+		}
+	}
+
+	// SetCommTimeouts(com, &ct1);	/* Set processing timeout of 2 sec */
+	ses->Timeout.tv_sec = 2;
+	ses->Timeout.tv_usec = 0;
+	for (ss = 0, fc = 0; ss < ns; ss = es + 1) {
+		/* Find a run of sectors to be erased */
+		es = ss;
+		if (!(ses->Erase & SECT_BIT(ss))) continue;
+		while (es + 1 < ns && (ses->Erase & SECT_BIT(es + 1))) es++;
+
+		/* Prepare to write/erase sectors and erase them */
+		put_mess(ses, ".");
+		if (ses->StubRun) {	/* The flash write code is running (streaming) */
+			st = stub_cmd(ses, 1, ss, es, 0, 0, NULL, 0, NULL);
+			if (st) {
+				put_mess(ses, st < 0 ? "timeout.\n" : "failed(IAP,%d).\n", st);
+				return 12;
+			}
+			continue;
+		}
+		fc = queue_cmd(ses, "P %u %u", ss, es);
+		if (!fc) fc = queue_cmd(ses, "E %u %u", ss, es);
+		if (fc) break;
+	}
+
+	if (!fc) fc = flush_cmds(ses);
+	// SetCommTimeouts(com, &ct2);	/* Restore processing timeout */
+	ses->Timeout.tv_sec = 0;
+	ses->Timeout.tv_usec = 500 * 1000;
+	if (fc) {
+		put_mess(ses, "failed(%c,%s).\n", fc, ses->Res);
+		return 12;
+	}
+
+	put_mess(ses, "passed.\n");
+	return 0;
+}
+
+
+
+
+static
+int write_flash (
+	// HANDLE com,
+	SESSION* ses
+)
+{
+	uint32_t wa, pc, n, i, k, ns, sn, cs, lo, hi, skip, dup, ba[64], sl[64];
+	int fc;
+	uint8_t blk[4096], st[sizeof ses->Blk / 64];	/* Block to be written and state of each slot in the data buffer (b0:valid, b1:used in this batch, b2:to be sent) */
+
+
+	put_mess(ses, "Writing.");
+
+	cs = ses->CopySize;
+	ns = ses->BuffSize / cs;	/* Number of block slots in the data buffer */
+	memset(st, 0, sizeof st);	/* Contents of the data buffer are not known yet */
+	wa = (ses->DataEnd + cs) & ~(cs - 1);	/* Write from high address block */
+	pc = skip = dup = 0;
+
+	while (wa > 0) {
+		/* Collect blocks to be written into the data buffer as many as possible */
+		/* A block identical to the one in the data buffer is copied from there instead of being sent again */
+		for (k = 0; k < ns; k++) st[k] &= 1;
+		for (n = 0; wa > 0 && n < sizeof ba / sizeof ba[0]; ) {
+			wa -= cs;
+			if (!(ses->Write & SECT_BIT(adr2sect(ses->Device, wa)))) continue;	/* Skip sectors not to be updated */
+			load_block(ses, blk, wa, cs);
+			for (i = 0; i < cs && blk[i] == 0xFF; i++) ;
+			if (i == cs) {	/* Skip blank block (the sector has been erased) */
+				skip += cs;
+				continue;
+			}
+			for (k = 0; k < ns && !((st[k] & 1) && !memcmp(&ses->Blk[k * cs], blk, cs)); k++) ;
+			if (k < ns) {	/* Found in the data buffer */
+				dup += cs;
+			} else {		/* Put it into a slot not used in this batch */
+				for (k = 0; k < ns && (st[k] & 2); k++) ;
+				if (k == ns) {	/* Data buffer is full, the block is written in next batch */
+					wa += cs;
+					break;
+				}
+				memcpy(&ses->Blk[k * cs], blk, cs);
+				st[k] = 1 | 4;
+			}
+			st[k] |= 2;
+			sl[n] = k; ba[n++] = wa;
+		}
+		if (!n) continue;
+
+		/* Send the new data blocks to SRAM */
+		for (lo = 0; lo < ns && !(st[lo] & 4); lo++) ;
+		for (hi = ns; hi > lo && !(st[hi - 1] & 4); hi--) ;
+		if (hi > lo) {
+			if (send_block(ses, lo * cs, (hi - lo) * cs)) return 13;
+			for (k = lo; k < hi; k++) st[k] = (st[k] & 2) | 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			/* Prepare a sector to write flash and copy RAM to flash (pipelined) */
+			sn = adr2sect(ses->Device, ba[i]);
+			fc = queue_cmd(ses, "P %u %u", sn, sn);
+			if (!fc) fc = queue_cmd(ses, "C %u %u %u", ba[i], ses->Device->XferAddr + sl[i] * cs, cs);
+			if (fc) {
+				put_mess(ses, "failed(%c,%s).\n", fc, ses->Res);
+				return 13;
+			}
+
+			if (pc % 0x2000 == 0) put_mess(ses, ".");	/* Display a progress indicator every 8K byte */
+			pc += cs;
+			ses->DataCnt += cs;
+		}
+		/* Complete the copy commands before the data buffer is overwritten */
+		fc = flush_cmds(ses);
+		if (fc) {
+			put_mess(ses, "failed(%c,%s).\n", fc, ses->Res);
+			return 13;
+		}
+	}
+
+	if (skip || dup) {
+		put_mess(ses, "passed (%u bytes in blank blocks skipped, %u bytes in same blocks not sent).\n", skip, dup);
+	} else {
+		put_mess(ses, "passed.\n");
+	}
+	return 0;
+}
+
+
+
+/* Pack a data block for the flash write code (LZ77 with byte aligned tokens) */
+/* Token 0-127 is followed by 1-128 literal bytes, token 128-255 copies 3-130 bytes from the distance in following 16-bit */
+static
+uint32_t pack_block (	/* Size of the packed data (0:not smaller than the block) */
+	const uint8_t* src,		/* Data block */
+	uint32_t size,			/* Size of the data block (up to 4096) */
+	uint8_t* dst			/* Buffer to store the packed data (size bytes) */
+)
+{
+	uint16_t head[4096];	/* Last position + 1 of each hash value of 3 bytes */
+	uint32_t i, j, h, d, len, lit, n;
+
+
+	memset(head, 0, sizeof head);
+	for (i = lit = n = 0; i <= size; ) {
+		len = d = 0;
+		if (i + 3 <= size) {	/* Find the last occurrence of the 3 bytes (distance 1 packs a run of a byte) */
+			h = ((uint32_t)(src[i] << 16 | src[i + 1] << 8 | src[i + 2]) * 2654435761U) >> 20;
+			j = head[h];
+			head[h] = (uint16_t)(i + 1);
+			if (j--) {
+				d = i - j;
+				for (len = 0; len < 130 && i + len < size && src[j + len] == src[i + len]; len++) ;
+			}
+		}
+		if (len >= 3 || i == size) {	/* Put the literals pending */
+			while (lit) {
+				j = lit > 128 ? 128 : lit;
+				if (n + 1 + j >= size) return 0;
+				dst[n++] = (uint8_t)(j - 1);
+				memcpy(&dst[n], &src[i - lit], j);
+				n += j; lit -= j;
+			}
+			if (i == size) break;
+		}
+		if (len >= 3) {	/* Put the match */
+			if (n + 3 >= size) return 0;
+			dst[n++] = (uint8_t)(0x80 + len - 3);
+			dst[n++] = (uint8_t)d; dst[n++] = (uint8_t)(d >> 8);
+			for (i++, len--; len; i++, len--) {	/* Register the positions in the match */
+				if (i + 3 <= size) head[((uint32_t)(src[i] << 16 | src[i + 1] << 8 | src[i + 2]) * 2654435761U) >> 20] = (uint16_t)(i + 1);
+			}
+		} else {
+			i++; lit++;
+		}
+	}
+	return n;
+}
+
+
+
+/* Write the flash memory with the flash write code running in the device RAM */
+/* Each block is sent in a binary frame and written by IAP without ISP commands */
+static
+int write_stub (
+	SESSION* ses
+)
+{
+	const DEVICE *dev = ses->Device;
+	uint8_t blk[4096], pk[4096];
+	uint32_t wa, pc, i, k, n, fs, ns, nk, skip, dup, pack;
+	int st;
+
+
+	put_mess(ses, "Writing.");
+	if (!ses->StubRun && start_stub(ses)) return 13;
+
+	fs = ses->FrameSize;
+	ns = stub_slots(ses);	/* Number of block slots in the data buffer */
+	wa = (ses->DataEnd + fs) & ~(fs - 1);	/* Write from high address block */
+	pc = skip = dup = nk = pack = 0;
+	while (wa > 0) {
+		wa -= fs;
+		if (!(ses->Write & SECT_BIT(adr2sect(dev, wa)))) continue;	/* Skip sectors not to be updated */
+		load_block(ses, blk, wa, fs);
+		for (i = 0; i < fs && blk[i] == 0xFF; i++) ;
+		if (i == fs) {	/* Skip blank block (the sector has been erased) */
+			skip += fs;
+			continue;
+		}
+		/* A block identical to the one in the data buffer is written from there instead of being sent again */
+		/* Slots hold the blocks sent last (ses->Blk mirrors the data buffer) */
+		for (k = 0; k < nk && memcmp(&ses->Blk[k * fs], blk, fs); k++) ;
+		if (k < nk) {
+			st = stub_cmd(ses, 4, wa, fs, adr2sect(dev, wa), k * fs, NULL, 0, NULL);
+			dup += fs;
+		} else {
+			k = (pc / fs) % ns;
+			if (nk < ns) nk++;
+			memcpy(&ses->Blk[k * fs], blk, fs);
+			n = pack_block(blk, fs, pk);
+			if (n) {	/* Send the block in packed form if it gets smaller */
+				st = stub_cmd(ses, 5, wa, fs, adr2sect(dev, wa), k * fs, pk, n, NULL);
+				pack += fs - n;
+			} else {
+				st = stub_cmd(ses, 2, wa, fs, adr2sect(dev, wa), k * fs, blk, fs, NULL);
+			}
+			pc += fs;
+		}
+		if (st) {
+			put_mess(ses, st < 0 ? "timeout.\n" : "failed(IAP,%d).\n", st);
+			return 13;
+		}
+		if ((pc + dup) % 0x2000 == 0) put_mess(ses, ".");	/* Display a progress indicator every 8K byte */
+		ses->DataCnt += fs;
+	}
+
+	if (skip || dup || pack || ses->Resend) {
+		put_mess(ses, "passed (%u bytes in blank blocks skipped, %u bytes in same blocks not sent, %u bytes saved by packing, %u frames resent).\n", skip, dup, pack, ses->Resend);
+	} else {
+		put_mess(ses, "passed.\n");
+	}
+	return 0;
+}
+
+
+
+void _pause (
+	int rc
+)
+{
+	if ((Pause == 2) || ((Pause == 1) && rc)) {
+		MESS("\nType Enter to exit...");
+		getchar();
+	}
+}
+
+
+
+/* Create a session for each port in the port list */
+static
+int init_sessions (void)
+{
+	char *cp = Port, *np;
+
+
+	for (Sessions = 0; ; cp = np) {
+		np = strchr(cp, ',');
+		if (np) *np++ = 0;
+		if (*cp) {
+			if (Sessions >= MAX_PORT) return 1;
+			Session[Sessions].Port = cp;
+			Session[Sessions].Com = -1;
+			Session[Sessions].QueTail = -1;
+			Sessions++;
+		}
+		if (!np) break;
+	}
+	Gang = (Sessions >= 2);
+	return Sessions ? 0 : 1;
+}
+
+
+
+/* Get the sector CRCs programmed into the device last time from the UID cache */
+static
+uint64_t find_uid (	/* Sectors with the CRC known (0:not found) */
+	SESSION* ses,
+	uint32_t* crc		/* CRC32 of each sector */
+)
+{
+	FILE *fp;
+	char line[1024], uid[40], *cp, *np;
+	uint32_t sign, sn;
+	uint64_t known = 0;
+
+
+	if (!ses->HasUid) return 0;
+	fp = fopen(UIDFILE, "rt");
+	if (!fp) return 0;
+	sprintf(uid, "%08X%08X%08X%08X", ses->Uid[0], ses->Uid[1], ses->Uid[2], ses->Uid[3]);
+	while (fgets(line, sizeof line, fp)) {	/* <UID> <signature> <CRC of sector 0 or -> <CRC of sector 1 or -> ... */
+		if (strncmp(line, uid, 32) || line[32] != ' ') continue;
+		sign = strtoul(&line[33], &cp, 10);
+		if (sign != ses->Device->Sign) break;	/* Another device type with the same UID? */
+		for (sn = 0; sn < 64; sn++) {
+			while (*cp == ' ') cp++;
+			if (*cp == '-') {
+				cp++;
+				continue;
+			}
+			crc[sn] = strtoul(cp, &np, 16);
+			if (np == cp) break;
+			known |= SECT_BIT(sn);
+			cp = np;
+		}
+		break;
+	}
+	fclose(fp);
+	return known;
+}
+
+
+/* Create a temporary file to replace a cache file */
+/* The cache file is replaced by rename() on close, so that other processes never see it partially written */
+static
+FILE* create_tmpfile (	/* NULL:failed */
+	const char* name,	/* Cache file name */
+	char* tmp			/* Temporary file name (returned, at least strlen(name) + 8 bytes) */
+)
+{
+	FILE *fp;
+	int fd;
+
+
+	sprintf(tmp, "%s.XXXXXX", name);
+	fd = mkstemp(tmp);
+	if (fd < 0) return NULL;
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "wt");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+	}
+	return fp;
+}
+
+
+/* Close the temporary file and replace the cache file with it */
+static
+void commit_tmpfile (
+	FILE* fp,			/* Temporary file */
+	const char* tmp,	/* Temporary file name */
+	const char* name	/* Cache file name */
+)
+{
+	if (fclose(fp) || rename(tmp, name)) unlink(tmp);
+}
+
+
+/* Save the sector CRCs programmed into the devices, the entries of other devices are kept */
+static
+void save_uids (void)
+{
+	FILE *fp;
+	SESSION *ses;
+	char *buf = NULL, line[1024], uid[MAX_PORT][40], tmp[sizeof UIDFILE + 8];
+	size_t len = 0;
+	uint32_t sn, ns;
+	int n;
+
+
+	for (n = 0; n < Sessions; n++) {
+		ses = &Session[n];
+		uid[n][0] = 0;
+		if (ses->UidUpdate) sprintf(uid[n], "%08X%08X%08X%08X", ses->Uid[0], ses->Uid[1], ses->Uid[2], ses->Uid[3]);
+	}
+	for (n = 0; n < Sessions && !uid[n][0]; n++) ;
+	if (n == Sessions) return;	/* Nothing to update */
+
+	fp = fopen(UIDFILE, "rt");
+	if (fp) {
+		while (fgets(line, sizeof line, fp)) {
+			for (n = 0; n < Sessions && (!uid[n][0] || strncmp(line, uid[n], 32)); n++) ;
+			if (n < Sessions) continue;		/* Replaced below */
+			buf = realloc(buf, len + strlen(line) + 1);
+			if (!buf) break;
+			strcpy(&buf[len], line);
+			len += strlen(line);
+		}
+		fclose(fp);
+	}
+	fp = create_tmpfile(UIDFILE, tmp);
+	if (fp) {
+		if (buf) fputs(buf, fp);
+		for (n = 0; n < Sessions; n++) {
+			ses = &Session[n];
+			if (!uid[n][0] || !ses->CrcValid) continue;	/* Entry is removed if flash memory is in unknown state */
+			fprintf(fp, "%s %u", uid[n], ses->Device->Sign);
+			ns = adr2sect(ses->Device, ses->Device->FlashSize - 1) + 1;
+			for (sn = 0; sn < ns; sn++) {
+				if (ses->CrcValid & SECT_BIT(sn)) {
+					fprintf(fp, " %08X", ses->SectCrc[sn]);
+				} else {
+					fprintf(fp, " -");
+				}
+			}
+			fprintf(fp, "\n");
+		}
+		commit_tmpfile(fp, tmp, UIDFILE);
+	}
+	free(buf);
+}
+
+
+/* Load the sync parameters learned on each port */
+static
+void load_syncs (void)
+{
+	FILE *fp;
+	char line[300], port[256];
+	uint32_t sign, wait;
+	int n, cr;
+
+
+	fp = fopen(SYNCFILE, "rt");
+	if (!fp) return;
+	while (fgets(line, sizeof line, fp)) {	/* <port> <signature> <boot time> <CR+LF> */
+		if (sscanf(line, "%255s %u %u %d", port, &sign, &wait, &cr) != 4) continue;
+		for (n = 0; n < Sessions; n++) {
+			if (!strcmp(Session[n].Port, port)) {
+				Session[n].SyncSign = sign;
+				Session[n].SyncWait = wait;
+				Session[n].SyncCr = cr;
+			}
+		}
+	}
+	fclose(fp);
+}
+
+
+/* Save the sync parameters learned, the entries of other ports are kept */
+static
+void save_syncs (void)
+{
+	FILE *fp;
+	char *buf = NULL, line[300], port[256], tmp[sizeof SYNCFILE + 8];
+	size_t len = 0;
+	int n;
+
+
+	for (n = 0; n < Sessions && !Session[n].SyncSign; n++) ;
+	if (n == Sessions) return;	/* Nothing learned */
+
+	fp = fopen(SYNCFILE, "rt");
+	if (fp) {
+		while (fgets(line, sizeof line, fp)) {
+			if (sscanf(line, "%255s", port) != 1) continue;
+			for (n = 0; n < Sessions && strcmp(Session[n].Port, port); n++) ;
+			if (n < Sessions) continue;		/* Replaced below */
+			buf = realloc(buf, len + strlen(line) + 1);
+			if (!buf) break;
+			strcpy(&buf[len], line);
+			len += strlen(line);
+		}
+		fclose(fp);
+	}
+	fp = create_tmpfile(SYNCFILE, tmp);
+	if (fp) {
+		if (buf) fputs(buf, fp);
+		for (n = 0; n < Sessions; n++) {
+			if (Session[n].SyncSign) {
+				fprintf(fp, "%s %u %u %d\n", Session[n].Port, Session[n].SyncSign, Session[n].SyncWait, Session[n].SyncCr);
+			}
+		}
+		commit_tmpfile(fp, tmp, SYNCFILE);
+	}
+	free(buf);
+}
+
+
+
+/* Check CRP of the data and create the vector table with valid check sum for the session */
 static
-int uudecode (				/* Returns number of bytes decoded (-1:error) */
-	const char* src,		/* Pointer to the input string */
-	unsigned char* dst		/* Pointer to the output buffer (must be 45 byte at least) */
+int check_vect (	/* Result code */
+	SESSION* ses
 )
 {
-	unsigned char b1, b2, b3, b4;
-	int bc, cc;
+	uint32_t s, n, i;
 
 
-	b1 = *(src++) - 0x20;
-	if (b1 > 64) return -1;
-	bc = b1 & 63;
+	read_image(ses->Device->CRP, ses->Vect, 4);
+	s = LD_DWORD(ses->Vect);
+	if (!Crp3 && (s == 0x43218765 || s == 0x4E697370)) {
+		put_mess(ses, "Programming aborted due to CRP3 or NO_ISP.\nSpecify -3 to force program these CRP options.\n");
+		return 1;
+	}
 
-	for (cc = bc; cc > 0; cc -= 3) {
-		b1 = *(src++) - 0x20;
-		if (b1 > 64) return -1;
-		b2 = *(src++) - 0x20;
-		if (b2 > 64) return -1;
-		*(dst++) = (b1 << 2) + ((b2 >> 4) & 3);
-		if (cc >= 2) {
-			b3 = *(src++) - 0x20;
-			if (b3 > 64) return -1;
-			*(dst++) = (b2 << 4) + ((b3 >> 2) & 15);
-			if (cc >= 3) {
-				b4 = *(src++) - 0x20;
-				if (b4 > 64) return -1;
-				*(dst++) = (b3 << 6) + (b4 & 63);
-			}
+	/* Validate application code (create check sum in the vector table of this session) */
+	read_image(0, ses->Vect, sizeof ses->Vect);
+	for (i = s = 0; i < 32; i += 4) {
+		s += LD_DWORD(&ses->Vect[i]);
+	}
+	i = ses->Device->Sum;
+	n = LD_DWORD(&ses->Vect[i]) - s;
+	ST_DWORD(&ses->Vect[i], n);
+	return 0;
+}
+
+
+
+/* Erase and write the selected sectors (ses->Erase, ses->Write) and verify them */
+static
+int program_sects (	/* Result code */
+	SESSION* ses,
+	uint64_t vsects		/* Sectors to be verified (-v) */
+)
+{
+	int rc = 0;
+
+
+	if (ses->Erase | ses->Write) ses->UidUpdate = ses->HasUid;	/* The cache entry is no longer valid */
+	if (ses->Erase) {
+		begin_phase(ses);
+		rc = erase_flash(ses);
+		end_phase(ses, PH_ERASE);
+	}
+	if (!rc && ses->Write) {
+		begin_phase(ses);
+		/* The flash write code is used if available, but not when the mismatched sectors are to be read back */
+		if (USE_STUB(ses)) {
+			rc = write_stub(ses);
+		} else {
+			rc = write_flash(ses);
 		}
+		end_phase(ses, PH_WRITE);
+	}
+	if (!rc && Verify && vsects) {
+		begin_phase(ses);
+		rc = verify_flash(ses, vsects);
+		end_phase(ses, PH_VERIFY);
 	}
+	return rc;
+}
 
-	return bc;
+
+
+/* Record CRC32 of the sectors programmed into the UID cache entry */
+static
+void record_crcs (
+	SESSION* ses,
+	uint64_t sects		/* Sectors to be recorded */
+)
+{
+	uint32_t s, sa, ss;
+
+
+	for (s = 0; s < 64; s++) {
+		if (!(sects & SECT_BIT(s))) continue;
+		sa = ses->Device->SectMap[s];
+		ss = ses->Device->SectMap[s + 1] - sa;
+		load_block(ses, ses->Blk, sa, ss);
+		ses->SectCrc[s] = crc32(ses->Blk, ss);
+		ses->CrcValid |= SECT_BIT(s);
+	}
 }
 
 
 
-/* Create CRC32 sum */
+/* Program the streamed data into a target as its sectors are completed */
+/* Sector 0 is erased first and written at last, so that the device does not start a partial application */
 static
-uint32_t crc32 (
-	const uint8_t* src,
-	unsigned int cnt
+int stream_target (	/* Result code */
+	SESSION* ses
 )
 {
-	uint32_t r, n;
+	const DEVICE *dev = ses->Device;
+	uint32_t ns, sn, done, range[2];
+	uint64_t sects;
+	int end, rc, first = 1;
 
 
-	r = 0xFFFFFFFF;
-    do {
-		r ^= *src++;
-		for (n = 0; n < 8; n++) {
-			r = r & 1 ? r >> 1 ^ 0xEDB88320 : r >> 1;
+	begin_phase(ses);
+	probe_ram(ses);
+	end_phase(ses, PH_PROBE);
+
+	/* Sector 0 is needed first for the CRP check and the vector check sum */
+	end = stream_wait(dev->SectMap[1], &done, range);
+	if (end < 0) {
+		put_mess(ses, "Streaming failed.\n");
+		return 2;
+	}
+	if (range[1] == 0 || range[0] != 0) {
+		put_mess(ses, "Vector table is not loaded.\n");
+		return 1;
+	}
+	rc = check_vect(ses);
+
+	ns = adr2sect(dev, dev->FlashSize - 1) + 1;	/* Number of sectors */
+	for (sn = 1; !rc; first = 0) {
+		if (range[1] >= dev->FlashSize) {
+			put_mess(ses, "Too large data for this device.\n");
+			rc = 1;
+			break;
 		}
-	} while (--cnt);
-    return ~r;
+
+		/* Sectors completed since the last batch */
+		for (sects = 0; sn < ns && dev->SectMap[sn + 1] <= done; sn++) {
+			if (image_used(dev->SectMap[sn], dev->SectMap[sn + 1] - dev->SectMap[sn])) sects |= SECT_BIT(sn);
+		}
+		if (end) sects |= SECT_BIT(0);	/* Sector 0 is the lowest, so written after the others */
+		ses->DataEnd = dev->SectMap[sn] - 1;
+
+		if (Verify && (VerifyOpt & 1)) {	/* Verify only */
+			ses->Erase = ses->Write = 0;
+		} else if (first) {	/* Sector 0 is erased with the first batch */
+			ses->Erase = EraseAll ? lower_sects(dev, dev->FlashSize - 1) : sects | SECT_BIT(0);
+			ses->Write = sects;
+		} else {	/* The whole flash memory has been erased with the first batch on -e */
+			ses->Erase = EraseAll ? 0 : sects & ~SECT_BIT(0);
+			ses->Write = sects;
+		}
+		rc = program_sects(ses, sects);
+		if (!rc && ses->HasUid) record_crcs(ses, sects);
+		if (rc || end) break;
+
+		/* Release the image of the sectors done and wait for the next sector */
+		stream_release(ses, dev->SectMap[sn]);
+		end = stream_wait((sn < ns) ? dev->SectMap[sn + 1] : MAX_IMAGE, &done, range);
+		if (end < 0) {
+			put_mess(ses, "Streaming failed.\n");
+			rc = 2;
+		}
+	}
+
+	if (ses->HasUid) {
+		if (rc) {
+			ses->CrcValid = 0;	/* Entry is removed if flash memory is in unknown state */
+		} else {
+			ses->UidUpdate = 1;
+		}
+	}
+	return rc;
 }
 
-static 
-int receive_serial (
-	int com,
-	void *buff,
-	int bufsize
+
+
+/* Program the loaded data into a target (thread function in gang mode) */
+static
+void* program_target (
+	void* arg
 )
 {
-	fd_set rfds;
-	int len = 0, ready, rc;
-	char *p = buff;
+	SESSION *ses = arg;
+	uint32_t crc[64];
+	uint64_t known = 0;
+	double t;
+	int isp;
+
+
+	t = get_time();
+	begin_phase(ses);
+	ses->Rc = enter_ispmode(ses);	/* Open port, enter ispmode and detect device type */
+	end_phase(ses, PH_SYNC);
+	isp = !ses->Rc;
+	if (!ses->Rc && Streaming) {	/* Program the data as it arrives */
+		ses->Rc = stream_target(ses);
+	} else if (!ses->Rc) {
+		ses->DataEnd = AddrRange[1];
+		if (ses->DataEnd >= ses->Device->FlashSize) {
+			put_mess(ses, "Too large data for this device.\n");
+			ses->Rc = 1;
+		}
+		if (!ses->Rc) ses->Rc = check_vect(ses);
+		if (!ses->Rc) {
+			begin_phase(ses);
+			probe_ram(ses);
+			end_phase(ses, PH_PROBE);
+			/* Erase sectors to be written (or entire flash memory) and write application code */
+			if (Verify && (VerifyOpt & 1)) {	/* Verify only */
+				ses->Erase = ses->Write = 0;
+			} else if (EraseAll) {
+				ses->Erase = lower_sects(ses->Device, ses->Device->FlashSize - 1);
+				ses->Write = image_sects(ses->Device);
+			} else if ((known = find_uid(ses, crc)) != 0 || Diff) {
+				begin_phase(ses);
+				ses->Rc = diff_flash(ses, crc, known);
+				end_phase(ses, PH_DIFF);
+			} else {
+				ses->Erase = ses->Write = image_sects(ses->Device);
+			}
+			if (!ses->Rc) ses->Rc = program_sects(ses, image_sects(ses->Device));
+			if (!ses->Rc && ses->HasUid) {	/* Record the sectors programmed into the UID cache */
+				record_crcs(ses, image_sects(ses->Device));
+				ses->UidUpdate = 1;
+			}
+		}
+	}
+	if (isp) {
+		if (!ses->Rc && ses->CmdTime > 0) {
+			put_mess(ses, "%u commands in %.2f sec (%.0f commands/sec).\n", ses->Cmds, ses->CmdTime, ses->Cmds / ses->CmdTime);
+		}
+		begin_phase(ses);
+		exit_ispmode(ses);
+		end_phase(ses, PH_EXIT);
+	}
+	if (Streaming) stream_release(ses, 0xFFFFFFFF);
+	ses->Time = get_time() - t;
 
-	while (len < bufsize) {
-		FD_ZERO(&rfds);
-		FD_SET(com, &rfds);
+	return NULL;
+}
 
-		ready = select(com + 1, &rfds, NULL, NULL, &timeout);
-		if (ready == 0) {
-			return 0;
-		} else if (ready == -1) {
-			if (errno == EAGAIN) {
-				continue;
+
+
+/* Read the flash memory of a target and output it in Intel HEX format */
+static
+int read_target (	/* Result code */
+	SESSION* ses,
+	FILE* fp		/* Output stream */
+)
+{
+	uint32_t n, i, d;
+	uint8_t *rbuf;
+	int rc, part;
+	double t;
+
+
+	t = get_time();
+	begin_phase(ses);
+	rc = enter_ispmode(ses);
+	end_phase(ses, PH_SYNC);
+	if (!rc) {
+		begin_phase(ses);
+		probe_ram(ses);
+		end_phase(ses, PH_PROBE);
+		n = (ses->Device->FlashSize + READ_BLOCK - 1) & ~(READ_BLOCK - 1);
+		rbuf = malloc(n);
+		if (rbuf) memset(rbuf, 0xFF, n);	/* Areas not read are blank */
+		part = (ReadRange[1] != 0);
+		if (part) {	/* Read the specified range */
+			if (ReadRange[1] > ses->Device->FlashSize) ReadRange[1] = ses->Device->FlashSize;
+			if (ReadRange[0] > ReadRange[1]) ReadRange[0] = ReadRange[1];
+		} else {			/* Read the sectors below the highest non-blank sector */
+			begin_phase(ses);
+			ReadRange[1] = used_flash(ses);
+			end_phase(ses, PH_READ);
+		}
+		begin_phase(ses);
+		rc = rbuf ? read_flash(ses, rbuf, ReadRange[0], ReadRange[1]) : 9;
+		end_phase(ses, PH_READ);
+		if (!rc) {
+			/* Check if application code is exist (sum of eight vector data) */
+			for (i = n = 0; i < 32; i += 4) {
+				n += LD_DWORD(&rbuf[i]);
+			}
+			if (part) {	/* Usage cannot be known from a part of flash memory */
+				fprintf(stderr, " Read address range is %05X-%05X.\n", ReadRange[0], ReadRange[1] - 1);
+			} else if (n) {
+				MESS("There is no valid program code.\n");
 			} else {
-				return 0;
+				for (i = n = 0; i < ses->Device->FlashSize; i += 4) {
+					if (LD_DWORD(&rbuf[i]) != 0xFFFFFFFF) n = i + 4;
+				}
+				d = n * 1000 / ses->Device->FlashSize;
+				fprintf(stderr, " %u.%u%% of flash memory is used.\n", d / 10, d % 10);
 			}
+			output_ihex(fp, rbuf, ses->Device->FlashSize, 32);
 		}
+		free(rbuf);
+		begin_phase(ses);
+		exit_ispmode(ses);
+		end_phase(ses, PH_EXIT);
+	}
+	ses->Rc = rc;
+	ses->Time = get_time() - t;
+
+	return rc;
+}
+
+
 
-		rc = read(com, p, bufsize - len);
-		if (rc < 0) return 0;
-		p += rc;
-		len += rc;
+/* Show the result of each port and return result code of the first failed port */
+static
+int report_gang (void)
+{
+	SESSION *ses;
+	int rc = 0, n, passed = 0;
+	char *cp, dev[16];
+
+
+	MESS("\nPort                     Device         Time  Result\n");
+	for (n = 0; n < Sessions; n++) {
+		ses = &Session[n];
+		if ((cp = strchr(ses->Msg, '\n')) != NULL) *cp = 0;
+		strcpy(dev, "-");
+		if (ses->Device && ses->Device->Sign) snprintf(dev, sizeof dev, "LPC%s", ses->Device->DeviceName);
+		fprintf(stderr, "%-24s %-12s %6.1fs  %s\n", ses->Port, dev, ses->Time, !ses->Rc ? "passed." : ses->Msg[0] ? ses->Msg : "failed.");
+		if (ses->Rc) {
+			if (!rc) rc = ses->Rc;
+		} else {
+			passed++;
+		}
 	}
-	return len;
+	fprintf(stderr, "%d of %d targets passed.\n", passed, Sessions);
+
+	return rc;
 }
 
-/* Get a line from the device */
+
+
+/* Show timing statistics of the sessions */
 static
-int rcvr_line (
-	// HANDLE com,
-	int com,
-	char* buff,
-	int bufsize
-)
+void report_stats (void)
 {
-	int rc, i = 0;
+	SESSION *ses;
+	RTTSTAT *st;
+	int n, ph, c, b;
 
 
-	for (;;) {
-		// ReadFile(com, &buff[i], 1, &rc, NULL);	/* Get a character */
-		rc = receive_serial(com, &buff[i], 1);
-		if (rc == 0) {	/* I/O error? */
-			i = 0; break;
+	for (n = 0; n < Sessions; n++) {
+		ses = &Session[n];
+		fprintf(stderr, "\nStatistics of %s:\n", ses->Port);
+		if (ses->SyncTry) {
+			fprintf(stderr, "Sync: %u request(s), %.3fs, boot time %ums, %s\n", ses->SyncTry, ses->PhTime[PH_SYNC],
+				ses->SyncWait, ses->SyncCr ? "CR+LF" : "LF");
 		}
-		if (buff[i] == '\n') break;			/* EOL? */
-		if ((uint8_t)buff[i] < 0x20) continue;	/* Ignore invisible chars */
-		i++;
-		if (i >= bufsize - 1) {				/* Buffer overflow? */
-			i = 0; break;
+		MESS("Phase        Time  Wire bytes   Wire B/s  Data bytes   Data B/s\n");
+		for (ph = 0; ph < N_PHASE; ph++) {
+			if (ses->PhTime[ph] <= 0) continue;
+			fprintf(stderr, "%-8s %7.3fs %11u %10.0f %11u %10.0f\n", PhName[ph], ses->PhTime[ph],
+				ses->PhWire[ph], ses->PhWire[ph] / ses->PhTime[ph], ses->PhData[ph], ses->PhData[ph] / ses->PhTime[ph]);
+		}
+		MESS("Command  Count   Min[ms]   Avg[ms]   Max[ms]  Histogram [ms]:count\n");
+		for (c = 0; RTT_CMDS[c]; c++) {
+			st = &ses->Rtt[c];
+			if (!st->Count) continue;
+			fprintf(stderr, "%-7c %6u %9.2f %9.2f %9.2f ", RTT_CMDS[c], st->Count, st->Min * 1000, st->Sum / st->Count * 1000, st->Max * 1000);
+			for (b = 0; b < RTT_BINS; b++) {
+				if (!st->Hist[b]) continue;
+				if (b < RTT_BINS - 1) {
+					fprintf(stderr, " <=%g:%u", 0.1 * (1 << b), st->Hist[b]);
+				} else {
+					fprintf(stderr, " >%g:%u", 0.1 * (1 << (b - 1)), st->Hist[b]);
+				}
+			}
+			MESS("\n");
 		}
 	}
-	buff[i] = 0;	/* Remove \n */
-	return i;
 }
 
-/* Control the RTS and DTR pins */
-static int ctrl_pin (int fd, pinfunc_t f)
+
+
+/* Put a string in JSON format */
+static
+void put_json_str (
+	FILE* fp,
+	const char* str
+)
 {
-	int flag;
-	switch (f) {
-		case CLRDTR:
-			flag = TIOCM_DTR;
-			return ioctl(fd, TIOCMBIC, &flag);
-		case CLRRTS:
-			flag = TIOCM_RTS;
-			return ioctl(fd, TIOCMBIC, &flag);
-		case SETDTR:
-			flag = TIOCM_DTR;
-			return ioctl(fd, TIOCMBIS, &flag);
-		case SETRTS:
-			flag = TIOCM_RTS;
-			return ioctl(fd, TIOCMBIS, &flag);
+	putc('"', fp);
+	for ( ; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(fp, "\\%c", *str);
+		} else if ((uint8_t)*str < 0x20) {
+			fprintf(fp, "\\u%04x", (uint8_t)*str);
+		} else {
+			putc(*str, fp);
+		}
+	}
+	putc('"', fp);
+}
+
+
+/* Write timing statistics of the sessions into a JSON file */
+static
+int write_stats (	/* 0:succeeded, 1:failed */
+	const char* fname
+)
+{
+	FILE *fp;
+	SESSION *ses;
+	RTTSTAT *st;
+	int n, ph, c, b, f;
+	double t;
+	char dev[16];
+
+
+	fp = fopen(fname, "w");
+	if (!fp) return 1;
+
+	fprintf(fp, "{\n  \"rtt_bins_ms\": [");	/* Upper bound of each bin (the last bin has no upper bound) */
+	for (b = 0; b < RTT_BINS; b++) fprintf(fp, "%s%g", b ? ", " : "", 0.1 * (1 << b));
+	fprintf(fp, "],\n  \"sessions\": [");
+	for (n = 0; n < Sessions; n++) {
+		ses = &Session[n];
+		strcpy(dev, "-");
+		if (ses->Device && ses->Device->Sign) snprintf(dev, sizeof dev, "LPC%s", ses->Device->DeviceName);
+		for (t = 0, ph = 0; ph < N_PHASE; ph++) t += ses->PhTime[ph];
+		fprintf(fp, "%s\n    {\n      \"port\": ", n ? "," : "");
+		put_json_str(fp, ses->Port);
+		fprintf(fp, ",\n      \"device\": ");
+		put_json_str(fp, dev);
+		fprintf(fp, ",\n      \"result\": %d,\n      \"time\": %.6f,\n", ses->Rc, t);
+		fprintf(fp, "      \"sync\": { \"time\": %.6f, \"requests\": %u, \"boot_ms\": %u, \"crlf\": %s },\n",
+			ses->PhTime[PH_SYNC], ses->SyncTry, ses->SyncWait, ses->SyncCr ? "true" : "false");
+		fprintf(fp, "      \"phases\": {");
+		for (f = 0, ph = 0; ph < N_PHASE; ph++) {
+			if (ses->PhTime[ph] <= 0) continue;
+			fprintf(fp, "%s\n        \"%s\": { \"time\": %.6f, \"wire_bytes\": %u, \"wire_bps\": %.0f, \"data_bytes\": %u, \"data_bps\": %.0f }",
+				f++ ? "," : "", PhName[ph], ses->PhTime[ph], ses->PhWire[ph], ses->PhWire[ph] / ses->PhTime[ph], ses->PhData[ph], ses->PhData[ph] / ses->PhTime[ph]);
+		}
+		fprintf(fp, "\n      },\n      \"commands\": {");
+		for (f = 0, c = 0; RTT_CMDS[c]; c++) {
+			st = &ses->Rtt[c];
+			if (!st->Count) continue;
+			fprintf(fp, "%s\n        \"%c\": { \"count\": %u, \"min_ms\": %.3f, \"avg_ms\": %.3f, \"max_ms\": %.3f, \"hist\": [",
+				f++ ? "," : "", RTT_CMDS[c], st->Count, st->Min * 1000, st->Sum / st->Count * 1000, st->Max * 1000);
+			for (b = 0; b < RTT_BINS; b++) fprintf(fp, "%s%u", b ? ", " : "", st->Hist[b]);
+			fprintf(fp, "] }");
+		}
+		fprintf(fp, "\n      }\n    }");
 	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	return fclose(fp) ? 1 : 0;
 }
 
 
 
-speed_t get_baud (int baud)
+
+/*-----------------------------------------------------------------------
+  Daemon mode (--serve=<socket>)
+-----------------------------------------------------------------------*/
+
+typedef struct {
+	char* Key;					/* File names with their modification/change time, i-node and size (NULL:unused) */
+	uint32_t Range[2];			/* Loaded address range */
+	uint32_t Pages;				/* Number of pages */
+	uint32_t* Index;			/* Page number of each page */
+	PAGE** Page;				/* Data of each page */
+	double Used;				/* Time last used */
+} IMGCACHE;
+
+IMGCACHE ImgCache[IMG_CACHE];	/* Parsed images (daemon mode) */
+
+
+/* Detach the current image from the page table (the pages are owned by the image cache) */
+static
+void clear_image (void)
 {
-	switch (baud) {
-		case 1200:
-			return B1200;
-		case 1800:
-			return B1800;
-		case 2400:
-			return B2400;
-		case 4800:
-			return B4800;
-		case 9600:
-			return B9600;
-		case 19200:
-			return B19200;
-		case 38400:
-			return B38400;
-#ifdef B7200
-		case 7200:
-			return B7200;
-#endif
-#ifdef B14400
-		case 14400:
-			return B14400;
-#endif
-#ifdef B28800
-		case 28800:
-			return B28800;
-#endif
-#ifdef B57600
-		case 57600:
-			return B57600;
-#endif
-#ifdef B76800
-    	case 76800:
-			return B76800;
-#endif
-#ifdef B115200
-		case 115200:
-			return B115200;
-#endif
-#ifdef B230400
-		case 230400:
-			return B230400;
-#endif
-		default:
-			fprintf(stderr, "Not defined baud rate: %d\n", baud);
-			return (speed_t)baud;
+	memset(Image, 0, sizeof Image);
+	AddrRange[0] = MAX_IMAGE;
+	AddrRange[1] = 0;
+}
+
+
+/* Release an image cache entry */
+static
+void free_cache (
+	IMGCACHE* ic
+)
+{
+	uint32_t i;
+
+
+	for (i = 0; i < ic->Pages; i++) free(ic->Page[i]);
+	free(ic->Index); free(ic->Page); free(ic->Key);
+	memset(ic, 0, sizeof *ic);
+}
+
+
+/* Select the image of the files, they are loaded only if not cached or changed */
+static
+int select_image (	/* 0:succeeded, 2:failed to load */
+	char* const files[],	/* File names (hex, S-record, ELF or <binary file>@<address>) */
+	int nfiles,
+	int* cached			/* 1:found in the cache */
+)
+{
+	IMGCACHE *ic, *lru;
+	struct stat st;
+	char key[4096], fn[1024], *cp;
+	size_t len = 0;
+	uint32_t i, p;
+	int n, rc = 0;
+
+
+	/* Create the cache key from the file names and their time stamps */
+	/* The time stamps are in nanoseconds, so that a file rewritten in the same second is loaded again */
+	for (n = 0; n < nfiles; n++) {
+		snprintf(fn, sizeof fn, "%s", files[n]);
+		cp = strrchr(fn, '@');
+		if (cp && stat(fn, &st)) *cp = 0;	/* <binary file>@<address> */
+		if (stat(fn, &st)) memset(&st, 0, sizeof st);
+		len += snprintf(&key[len], sizeof key - len, "%s %ld.%09ld %ld.%09ld %ld %ld\n", files[n],
+			(long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, (long)st.st_ctim.tv_sec, (long)st.st_ctim.tv_nsec,
+			(long)st.st_ino, (long)st.st_size);
+		if (len >= sizeof key) return 2;
+	}
+
+	clear_image();
+	for (ic = ImgCache, lru = ImgCache; ic < &ImgCache[IMG_CACHE]; ic++) {
+		if (ic->Key && !strcmp(ic->Key, key)) break;
+		if (!ic->Key || (lru->Key && ic->Used < lru->Used)) lru = ic;
+	}
+	*cached = (ic < &ImgCache[IMG_CACHE]);
+	if (!*cached) {	/* Load the files into the least recently used entry */
+		for (n = 0; n < nfiles && !rc; n++) rc = load_file(files[n]);
+		ic = lru;
+		free_cache(ic);
+		for (p = i = 0; p < MAX_IMAGE / IMG_PAGE; p++) {
+			if (Image[p]) i++;
+		}
+		ic->Index = malloc(i * sizeof *ic->Index);
+		ic->Page = malloc(i * sizeof *ic->Page);
+		for (p = 0; p < MAX_IMAGE / IMG_PAGE; p++) {
+			if (!Image[p]) continue;
+			if (ic->Index && ic->Page) {
+				ic->Index[ic->Pages] = p;
+				ic->Page[ic->Pages++] = Image[p];
+			} else {
+				free(Image[p]);
+			}
+		}
+		ic->Range[0] = AddrRange[0]; ic->Range[1] = AddrRange[1];
+		if (rc || !ic->Index || !ic->Page || !(ic->Key = strdup(key))) {
+			free_cache(ic);
+			clear_image();
+			return 2;
+		}
 	}
-}
 
+	/* Put the cached image in the page table */
+	clear_image();
+	for (i = 0; i < ic->Pages; i++) Image[ic->Index[i]] = ic->Page[i];
+	AddrRange[0] = ic->Range[0]; AddrRange[1] = ic->Range[1];
+	ic->Used = get_time();
+
+	return 0;
+}
 
 
+/* Initialize a session for the next job (the port and sync parameters are kept) */
 static
-int enter_ispmode (
-	int* com
+void reset_session (
+	SESSION* ses
 )
 {
-	// DCB dcb = { sizeof(DCB),
-	// 			Baud, TRUE, FALSE, FALSE, FALSE,
-	// 			DTR_CONTROL_DISABLE, FALSE,
-	// 			TRUE, FALSE, FALSE, FALSE, FALSE,
-	// 			RTS_CONTROL_DISABLE, FALSE, 0, 0,
-	// 			10, 10,
-	// 			8, NOPARITY, ONESTOPBIT, '\x11', '\x13', '\xFF', '\xFF', 0 };
-	// COMMTIMEOUTS ct1 = { 0, 1, 50, 1, 50},
-	// 			 ct2 = { 0, 1, 500, 1, 500};
-	tio.c_cflag += CREAD;               // 受信有効
-    tio.c_cflag += CLOCAL;              // ローカルライン（モデム制御なし）
-    tio.c_cflag += CS8;                 // データビット:8bit
-    tio.c_cflag += 0;                   // ストップビット:1bit
-    tio.c_cflag += 0;                   // パリティ:None
+	const char *port = ses->Port;
+	int com = ses->Com, cr = ses->SyncCr;
+	struct termios tio = ses->Tio, otio = ses->OldTio;
+	uint32_t sign = ses->SyncSign, wait = ses->SyncWait;
 
-	char str[20];
-	// HANDLE h;
-	int h;
-	uint32_t wc, n, m;
-	int rc = 0;
 
+	memset(ses, 0, sizeof *ses);
+	ses->Port = port; ses->Com = com; ses->Tio = tio; ses->OldTio = otio;
+	ses->SyncSign = sign; ses->SyncWait = wait; ses->SyncCr = cr;
+	ses->QueTail = -1;
+}
 
-	/* Open communication port */
-	// sprintf(str, "\\\\.\\COM%u", Port);
-	// *com = h = CreateFile(str, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	*com = h = open(Port, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	// if (h == INVALID_HANDLE_VALUE) {
-	if (h < 0) {
-		// fprintf(stderr, "%s could not be opened.\n", str);
-		fprintf(stderr, "%s could not be opened.\n", Port);
-		return 5;
+
+/* Put the result of a job in JSON */
+static
+void put_reply (
+	FILE* fp,
+	const char* job,
+	int rc,
+	double t,			/* Processing time of the job [sec] */
+	const char* err,	/* Error message (NULL:no error) */
+	int img,			/* Image information (-1:no image, 0:loaded, 1:cached) */
+	const int* sel		/* Ports run (NULL:no port) */
+)
+{
+	SESSION *ses;
+	const char *cp;
+	char dev[16];
+	int n, f;
+
+
+	fprintf(fp, "{\"job\": ");
+	put_json_str(fp, job);
+	fprintf(fp, ", \"result\": %d, \"time\": %.3f", rc, t);
+	if (err) {
+		fprintf(fp, ", \"error\": ");
+		put_json_str(fp, err);
 	}
-	tcgetattr(h, &oldtio); /* Save current port settings */
-	// SetCommState(h, &dcb);		/* Set serial bit rate */
-	// SetCommTimeouts(h, &ct1);	/* Set processing timeout of 200m sec */
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 200 * 1000; /* Set processing timeout of 200m sec */
-	// EscapeCommFunction(h, (Pol & 2) ? SETRTS : CLRRTS);	/* Set BOOT pin low if RTS controls it */
-	cfsetspeed(&tio, get_baud(Baud)); /* Set serial bit rate */
-	cfmakeraw(&tio); /* Set the LAW mode */
-    tcsetattr(h, TCSANOW, &tio); /* Reflect settings */
-	ctrl_pin(h, (Pol & 2) ? SETRTS : CLRRTS); /* Set BOOT pin low if RTS controls it */
+	if (img >= 0) {
+		fprintf(fp, ", \"image\": { \"start\": %u, \"end\": %u, \"cached\": %s }", AddrRange[0], AddrRange[1], img ? "true" : "false");
+	}
+	if (sel) {
+		fprintf(fp, ", \"ports\": [");
+		for (f = n = 0; n < Sessions; n++) {
+			if (!sel[n]) continue;
+			ses = &Session[n];
+			strcpy(dev, "-");
+			if (ses->Device && ses->Device->Sign) snprintf(dev, sizeof dev, "LPC%s", ses->Device->DeviceName);
+			fprintf(fp, "%s{\"port\": ", f++ ? ", " : "");
+			put_json_str(fp, ses->Port);
+			fprintf(fp, ", \"device\": ");
+			put_json_str(fp, dev);
+			fprintf(fp, ", \"result\": %d, \"time\": %.3f, \"sync\": %.3f, \"message\": ", ses->Rc, ses->Time, ses->PhTime[PH_SYNC]);
+			ses->Msg[strcspn(ses->Msg, "\n")] = 0;
+			cp = !ses->Rc ? "passed." : ses->Msg[0] ? ses->Msg : "failed.";
+			put_json_str(fp, cp);
+			fprintf(fp, "}");
+		}
+		fprintf(fp, "]");
+	}
+	fprintf(fp, "}\n");
+	fflush(fp);
+}
 
-	MESS("Entering ISP mode.");
-	for (n = 2; n; n--) {
-		/* Reset the device if DTR signal controls RESET pin */
-		// EscapeCommFunction(h, (Pol & 1) ? SETDTR : CLRDTR);
-		ctrl_pin(h, (Pol & 1) ? SETDTR : CLRDTR);
-		// Sleep(50);
-		usleep(50000);
-		// EscapeCommFunction(h, (Pol & 1) ? SETDTR : CLRDTR);
-		ctrl_pin(h, (Pol & 1) ? CLRDTR : SETDTR);
-		// Sleep(50);
-		usleep(50000);
 
-		for (m = 0; m < 12; m++) {
-			// PurgeComm(h, PURGE_RXABORT|PURGE_RXCLEAR);
-			tcflush(h, TCIOFLUSH);
-			// WriteFile(h, "?", 1, &wc, NULL);
-			wc = write(h, "?", 1);
-			if (rcvr_line(h, str, sizeof str) && !strcmp(str, "Synchronized")) {
-				Del = ((n & 1) ^ (int)(m == 0)) ? "\r\n" : "\n";
-				sprintf(str, "Synchronized%s", Del);
-				// WriteFile(h, str, strlen(str), &wc, NULL);
-				wc = write(h, str, strlen(str));
-				rcvr_line(h, str, sizeof str);
-				if (rcvr_line(h, str, sizeof str) && !strcmp(str, "OK")) break;
-				if (m) m = 12;
+/* Process a job request and reply its result */
+static
+int do_job (	/* 0:continue, 1:quit */
+	char* req,	/* Request line */
+	FILE* fp	/* Reply stream */
+)
+{
+	char *tok[64], *files[64], *job, *cp, *np, *out = NULL;
+	int ntok, nfiles = 0, n, i, rc = 0, cached = -1, sel[MAX_PORT], run[MAX_PORT];
+	pthread_t th[MAX_PORT];
+	FILE *ofp;
+	double t = get_time();
+
+
+	for (ntok = 0, cp = strtok(req, " \t\r\n"); cp && ntok < 64; cp = strtok(NULL, " \t\r\n")) tok[ntok++] = cp;
+	if (!ntok) return 0;
+	job = tok[0];
+
+	/* Options of the job (the defaults are the command line options) */
+	Verify = DefVerify; VerifyOpt = DefVerifyOpt; Diff = DefDiff; EraseAll = DefEraseAll; Crp3 = DefCrp3;
+	ReadRange[0] = ReadRange[1] = 0;
+	for (n = 0; n < Sessions; n++) sel[n] = 1;
+	for (n = 1; n < ntok; n++) {
+		cp = tok[n];
+		if (*cp != '-') {	/* Data file, or output file of read */
+			if (!strcmp(job, "read")) {
+				out = cp;
+			} else {
+				files[nfiles++] = cp;
 			}
+			continue;
+		}
+		switch (*++cp) {
+		case 'v' :	/* -v[<flag>] */
+			Verify = 1;
+			VerifyOpt = strtoul(cp + 1, &cp, 10);
+			break;
+		case 'd' :	/* -d */
+			Diff = 1; cp++;
+			break;
+		case 'e' :	/* -e */
+			EraseAll = 1; cp++;
+			break;
+		case '3' :	/* -3 */
+			Crp3 = 1; cp++;
+			break;
+		case 'r' :	/* -r<start>-<end> */
+			ReadRange[0] = strtoul(cp + 1, &cp, 0);
+			if (*cp++ != '-') rc = 1;
+			ReadRange[1] = strtoul(cp, &cp, 0) + 1;
+			if (ReadRange[1] <= ReadRange[0]) rc = 1;
+			break;
+		case 'p' :	/* -p<name>[,<name>...] (ports to be used) */
+			memset(sel, 0, sizeof sel);
+			for (cp++; *cp; cp = np) {
+				np = cp + strcspn(cp, ",");
+				for (n = 0; n < Sessions && (strncmp(Session[n].Port, cp, np - cp) || Session[n].Port[np - cp]); n++) ;
+				if (n == Sessions) rc = 1; else sel[n] = 1;
+				if (*np) np++;
+			}
+			break;
+		default :
+			rc = 1;
+		}
+		if (*cp) rc = 1;	/* Option trails garbage */
+		if (rc) {
+			put_reply(fp, job, 1, get_time() - t, "invalid option", -1, NULL);
+			return 0;
 		}
-		if (m < 12) break;
 	}
-	if (n) {
-		sprintf(str, "%u%s", Freq, Del);
-		// WriteFile(h, str, strlen(str), &wc, NULL);
-		wc = write(h, str, strlen(str));
-		rcvr_line(h, str, sizeof str);
-		if (!rcvr_line(h, str, sizeof str) || strcmp(str, "OK")) n = 0;
+	if (EraseAll && Diff) {
+		put_reply(fp, job, 1, get_time() - t, "-e and -d cannot be used together", -1, NULL);
+		return 0;
 	}
-	if (!n) {
-		MESS("failed to sync.\n");
-		rc = 6;
+
+	if (!strcmp(job, "quit")) {
+		put_reply(fp, job, 0, 0, NULL, -1, NULL);
+		return 1;
 	}
-	if (!rc) {
-		MESS(".");
-		sprintf(str, "A 0%s", Del);
-		// WriteFile(h, str, strlen(str), &wc, NULL);	/* Echo Off */
-		wc = write(h, str, strlen(str));
-		rcvr_line(h, str, sizeof str);
-		if (!rcvr_line(h, str, sizeof str) || strcmp(str, "0")) {
-			MESS("failed(A).\n");
-			rc = 6;
+
+	if (!strcmp(job, "program") || !strcmp(job, "verify")) {
+		if (!strcmp(job, "verify")) {
+			Verify = 1; VerifyOpt |= 1;
 		}
-	}
-	if (!rc) {
-		MESS(".");
-		sprintf(str, "J%s", Del);
-		// WriteFile(h, str, strlen(str), &wc, NULL);	/* Get device ID */
-		wc = write(h, str, strlen(str));
-		if (!rcvr_line(h, str, sizeof str) || strcmp(str, "0")) {
-			MESS("failed(J).\n");
-			rc = 6;
-		} else {
-			/* Find target device type by device ID */
-			rcvr_line(h, str, sizeof str);
-			wc = atol(str);
-			for (Device = DevLst; Device->Sign != wc && Device->Sign; Device++) ;
-			if (!Device->Sign) {
-				fprintf(stderr, " unknown device (%u).", wc);
-				rc = 6;
+		if (!nfiles || select_image(files, nfiles, &cached)) {
+			put_reply(fp, job, 2, get_time() - t, nfiles ? "failed to load the image" : "no file", -1, NULL);
+			return 0;
+		}
+		if (AddrRange[1] == 0 || AddrRange[0] != 0) {
+			put_reply(fp, job, 1, get_time() - t, "vector table is not loaded", cached, NULL);
+			return 0;
+		}
+		for (n = 0; n < Sessions; n++) {
+			if (!sel[n]) continue;
+			reset_session(&Session[n]);
+			run[n] = !pthread_create(&th[n], NULL, program_target, &Session[n]);
+			if (!run[n]) {
+				Session[n].Rc = 7;
+				strcpy(Session[n].Msg, "failed to create thread.");
 			}
 		}
-	}
-	if (!rc) {
-		MESS(".");
-		sprintf(str, "U 23130%s", Del);	/* Unlock */
-		// WriteFile(h, str, strlen(str), &wc, NULL);
-		wc = write(h, str, strlen(str));
-		if (!rcvr_line(h, str, sizeof str) || strcmp(str, "0")) {
-			MESS("failed(U).\n");
-			rc = 6;
+		for (n = 0; n < Sessions; n++) {
+			if (sel[n] && run[n]) pthread_join(th[n], NULL);
+			if (sel[n] && Session[n].Rc && !rc) rc = Session[n].Rc;
 		}
-	}
-	if (!rc) {
-		fprintf(stderr, "passed.\nDetected device is LPC%s (%uK).\n", Device->DeviceName, Device->FlashSize / 1024);
-		// SetCommTimeouts(h, &ct2);	/* Set processing timeout of 500m sec */
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 500 * 1000;
+
+	} else if (!strcmp(job, "read")) {
+		for (i = n = 0; n < Sessions; n++) i += sel[n];
+		if (!out || i != 1) {
+			put_reply(fp, job, 1, get_time() - t, !out ? "no output file" : "read can be done with only a port", -1, NULL);
+			return 0;
+		}
+		for (n = 0; !sel[n]; n++) ;
+		ofp = fopen(out, "w");
+		if (!ofp) {
+			put_reply(fp, job, 2, get_time() - t, "failed to create the output file", -1, NULL);
+			return 0;
+		}
+		reset_session(&Session[n]);
+		rc = read_target(&Session[n], ofp);
+		if (fclose(ofp) && !rc) rc = 2;
+
+	} else {
+		put_reply(fp, job, 1, get_time() - t, "unknown job", -1, NULL);
+		return 0;
 	}
 
-	return rc;
-}
+	save_syncs();
+	save_uids();
+	if (Stats) report_stats();
+	if (StatsFile[0]) write_stats(StatsFile);
+	put_reply(fp, job, rc, get_time() - t, NULL, cached, sel);
 
+	return 0;
+}
 
 
+/* Serve jobs on the UNIX domain socket until a quit job is received */
 static
-void exit_ispmode (
-	// HANDLE com
-	int com
-)
+int serve_jobs (void)
 {
-	/* Apply a reset to the device if DTR/RTS controls RESET/BOOT pin */
-	// EscapeCommFunction(com, (Pol & 2) ? CLRRTS : SETRTS);	/* Set BOOT pin high */
-	ctrl_pin(com, (Pol & 2) ? CLRRTS : SETRTS);	/* Set BOOT pin high */
-	// EscapeCommFunction(com, (Pol & 1) ? SETDTR : CLRDTR);	/* Set RESET pin low */
-	ctrl_pin(com, (Pol & 1) ? SETDTR : CLRDTR);	/* Set RESET pin low */
-	// Sleep(50);
-	usleep(50000);
-	// EscapeCommFunction(com, (Pol & 1) ? CLRDTR : SETDTR);	/* Set RESET pin high */
-	ctrl_pin(com, (Pol & 1) ? CLRDTR : SETDTR);	/* Set RESET pin high */
+	struct sockaddr_un sa;
+	char line[4096];
+	int sock, fd, quit = 0;
+	FILE *rfp, *wfp;
+
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) return 5;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, ServeSock);
+	unlink(ServeSock);
+	if (bind(sock, (struct sockaddr*)&sa, sizeof sa) || listen(sock, 4)) {
+		fprintf(stderr, "%s could not be created.\n", ServeSock);
+		close(sock);
+		return 5;
+	}
+	signal(SIGPIPE, SIG_IGN);	/* Client may leave before the reply */
+	Gang = 1;	/* Messages are recorded in the session and replied to the client */
+	fprintf(stderr, "Serving jobs on %s.\n", ServeSock);
+
+	while (!quit) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		rfp = fdopen(fd, "r");
+		wfp = fdopen(dup(fd), "w");
+		if (rfp && wfp) {
+			while (!quit && fgets(line, sizeof line, rfp)) quit = do_job(line, wfp);
+		}
+		if (wfp) fclose(wfp);
+		if (rfp) fclose(rfp); else close(fd);
+	}
 
-	tcsetattr(com, TCSANOW, &oldtio);
-    close(com);
+	close(sock);
+	unlink(ServeSock);
+	for (fd = 0; fd < Sessions; fd++) close_port(&Session[fd]);	/* Close the ports */
+	return 0;
 }
 
 
 
 
+/*-----------------------------------------------------------------------
+  Self test (--test)
+-----------------------------------------------------------------------*/
+
+#define TEST_SIZE 0x100000	/* Size of the test data of the throughput measurement */
+#define TEST_TIME 0.2		/* Time to measure the throughput of a function [sec] */
+#define TEST_HEX 0x400000	/* Size of the data in the hex files of the loader test */
+
+static volatile uint32_t TestSink;	/* Results of the measurements (not to be optimized out) */
+
+
+/* Fill a buffer with the pseudo random pattern */
 static
-int read_flash (
-	// HANDLE com,
-	int com,
-	uint8_t* buffer
+void test_pattern (
+	uint8_t* buf,
+	uint32_t size
 )
 {
-	uint32_t addr, cc, xc, sum, d, bx;
-	uint16_t dsum, vsum;
-	int i;
-	char buf[80];
+	uint32_t r = 1;
 
 
-	MESS("Reading.");
+	while (size--) {
+		r = r * 1103515245 + 12345;
+		*buf++ = (uint8_t)(r >> 16);
+	}
+}
 
-	/* Download user code to read flash with remapping disabled */
-	sprintf(buf, "W %u %u%s", Device->XferAddr, SZ_CODE, Del);
-	// WriteFile(com, buf, strlen(buf), &bx, NULL);
-	bx = write(com, buf, strlen(buf));
-	if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-		fprintf(stderr, "failed(W,%s).\n", buf);
-		return 10;
+
+/* Put a throughput in MB/s */
+static
+void test_speed (
+	const char* name,
+	double t,			/* Time [sec] */
+	double bytes		/* Bytes processed in the time */
+)
+{
+	printf("  %-26s %9.1f MB/s\n", name, bytes / t / 1e6);
+}
+
+
+/* Check the CRC32 implementations against known answers and each other */
+static
+int test_crc (			/* Number of errors */
+	uint8_t* buf		/* Work buffer (TEST_SIZE) */
+)
+{
+	static const struct { const char* str; uint32_t crc; } kat[] = {
+		{ "123456789", 0xCBF43926 },
+		{ "The quick brown fox jumps over the lazy dog", 0x414FA339 }
+	};
+	static const struct { uint32_t len, crc; } pat[] = {	/* CRC32 of the head of the test pattern */
+		{ 1, 0xA0058808 }, { 7, 0xA6AB295D }, { 64, 0x3C04B8AB }, { 80, 0xC72D0606 }, { 1000, 0x1F52FD1C }, { 4096, 0x4641A512 }
+	};
+	uint32_t i, n;
+	int err = 0;
+	double t;
+
+
+	for (i = 0; i < sizeof kat / sizeof kat[0]; i++) {
+		n = strlen(kat[i].str);
+		if (crc32_bit((const uint8_t*)kat[i].str, n) != kat[i].crc) err++;
+		if (~crc32_sb8(0xFFFFFFFF, (const uint8_t*)kat[i].str, n) != kat[i].crc) err++;
+		if (crc32((const uint8_t*)kat[i].str, n) != kat[i].crc) err++;
 	}
-	if (Device->RawMode) {
-		// WriteFile(com, Device->Code, SZ_CODE, &bx, NULL);
-		bx = write(com, Device->Code, SZ_CODE);
-	} else {
-		for (xc = sum = 0; xc < SZ_CODE; xc += cc) {
-			cc = (xc + 45 <= SZ_CODE) ? 45 : SZ_CODE - xc;
-			uuencode(&Device->Code[xc], cc, buf);
-			strcat(buf, "\r\n");
-			// WriteFile(com, buf, strlen(buf), &bx, NULL);
-			bx = write(com, buf, strlen(buf));
-			for (d = 0; d < cc; d++) sum += Device->Code[xc + d];
-		}
-		sprintf(buf, "%u\r\n", sum);
-		// WriteFile(com, buf, strlen(buf), &bx, NULL);
-		bx = write(com, buf, strlen(buf));
-		if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "OK")) {
-			fprintf(stderr, "failed(%s).\n", buf);
-			return 10;
-		}
+	memset(buf, 0, 32);
+	if (crc32_bit(buf, 32) != 0x190A55AD || crc32(buf, 32) != 0x190A55AD) err++;
+	memset(buf, 0xFF, 32);
+	if (crc32_bit(buf, 32) != 0xFF6CAB0B || crc32(buf, 32) != 0xFF6CAB0B) err++;
+
+	test_pattern(buf, TEST_SIZE);
+	for (i = 0; i < sizeof pat / sizeof pat[0]; i++) {
+		if (crc32_bit(buf, pat[i].len) != pat[i].crc) err++;
+		if (~crc32_sb8(0xFFFFFFFF, buf, pat[i].len) != pat[i].crc) err++;
+#ifdef USE_X86_SIMD
+		if (CrcFold && pat[i].len >= 64 && pat[i].len % 16 == 0 && ~crc32_clmul(0xFFFFFFFF, buf, pat[i].len) != pat[i].crc) err++;
+#endif
+	}
+	for (n = 1; n <= 4096; n++) {	/* Every length and alignment through the selected implementation */
+		if (crc32(buf + n % 16, n) != crc32_bit(buf + n % 16, n)) err++;
 	}
+	printf("CRC32: %s (%s)\n", err ? "NG" : "OK", CrcFold ? "folding" : "slicing-by-8");
+
+	for (n = 0, t = get_time(); get_time() - t < TEST_TIME; n++) TestSink = crc32_bit(buf, 0x10000);
+	test_speed("bitwise", get_time() - t, n * 65536.0);
+	for (n = 0, t = get_time(); get_time() - t < TEST_TIME; n++) TestSink = crc32_sb8(0xFFFFFFFF, buf, TEST_SIZE);
+	test_speed("slicing-by-8", get_time() - t, n * (double)TEST_SIZE);
+#ifdef USE_X86_SIMD
+	if (CrcFold) {
+		for (n = 0, t = get_time(); get_time() - t < TEST_TIME; n++) TestSink = crc32_clmul(0xFFFFFFFF, buf, TEST_SIZE);
+		test_speed("folding", get_time() - t, n * (double)TEST_SIZE);
+	}
+#endif
 
-	/* Execute the loaded code */
-	sprintf(buf, "G %u T%s", Device->XferAddr, Del);
-	// WriteFile(com, buf, strlen(buf), &bx, NULL);
-	bx = write(com, buf, strlen(buf));
-	if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-		fprintf(stderr, "failed(G,%s).\n", buf);
-		return 10;
+	return err;
+}
+
+
+/* Check the uuencode/uudecode against known answers, the scalar encoder and each other */
+static
+int test_uucode (		/* Number of errors */
+	uint8_t* buf		/* Work buffer (TEST_SIZE) */
+)
+{
+	static const struct { const char* bin; int len; const char* str; } kat[] = {
+		{ "Cat", 3, "#0V%T" },
+		{ "\0\0\0", 3, "#````" },
+		{ "\0\1\2\3\4\5\6\7\10\11\12\13\14\15\16\17\20\21\22\23\24\25\26\27\30\31\32\33\34\35\36\37\40\41\42\43\44\45\46\47\50\51\52\53\54", 45,
+		  "M``$\"`P0%!@<(\"0H+#`T.#Q`1$A,4%187&!D:&QP='A\\@(2(C)\"4F)R@I*BLL" }
+	};
+	char str[64], ref[64];
+	uint8_t dec[64];
+	uint32_t i, n;
+	int simd = UuSimd, err = 0, len, ofs, set;
+	double t;
+
+
+	for (i = 0; i < sizeof kat / sizeof kat[0]; i++) {
+		uuencode(kat[i].bin, kat[i].len, str);
+		if (strcmp(str, kat[i].str) || uudecode(str, dec) != kat[i].len || memcmp(dec, kat[i].bin, kat[i].len)) err++;
 	}
 
-	/* Receive flash memory data and store it to the buffer */
-	addr = 0;
-	do {
-		buffer[addr] = 0xAA;
-		// WriteFile(com, &buffer[addr], 1, &bx, NULL);	/* Send a 0xAA to start to transmit a 1KB block */
-		bx = write(com, &buffer[addr], 1); /* Send a 0xAA to start to transmit a 1KB block */
-		// ReadFile(com, &buffer[addr], 1024, &bx, NULL);	/* Receive a data block */
-		bx = receive_serial(com, &buffer[addr], 1024); /* Receive a data block */
-		if (bx < 1024) {
-			MESS("timeout.\n");
-			return 11;
+	for (set = 0; set < 3; set++) {	/* Random, zero-heavy and blank data */
+		test_pattern(buf, 4096);
+		for (i = 0; i < 4096; i++) {
+			if (set == 1 && buf[i] % 8) buf[i] = 0;
+			if (set == 2) buf[i] = 0xFF;
 		}
-		// ReadFile(com, &vsum, 2, &bx, NULL);				/* Receive BCC */
-		bx = receive_serial(com, &vsum, 2); /* Receive BCC */
-		if (bx < 2) {
-			MESS("timeout.\n");
-			return 11;
+		for (len = 0; len <= 45; len++) {	/* Every line length at every alignment */
+			for (ofs = 0; ofs < 16; ofs++) {
+				UuSimd = 0;
+				uuencode(&buf[set * 64 + len * 16 + ofs], len, ref);
+				UuSimd = simd;
+				uuencode(&buf[set * 64 + len * 16 + ofs], len, str);
+				if (strcmp(str, ref) || (int)strlen(str) != 1 + (len + 2) / 3 * 4) err++;
+				if (uudecode(str, dec) != len || memcmp(dec, &buf[set * 64 + len * 16 + ofs], len)) err++;
+			}
 		}
-		for (i = dsum = 0; i < 1024; dsum += buffer[addr + i], i++) ;
-		if (dsum != vsum) {
-			MESS("data error.\n");
-			return 11;
+	}
+	str[0] = 'M'; str[1] = '~'; str[2] = 0;	/* Invalid character */
+	if (uudecode(str, dec) != -1) err++;
+	printf("uuencode: %s (%s)\n", err ? "NG" : "OK", simd ? "SSSE3" : "scalar");
+
+	test_pattern(buf, TEST_SIZE);
+	for (set = 0; set < 2; set++) {
+		if (set && !simd) break;
+		UuSimd = set;
+		for (n = 0, t = get_time(); get_time() - t < TEST_TIME; n++) {
+			for (i = 0; i + 45 <= TEST_SIZE; i += 45) uuencode(&buf[i], 45, str);
+			TestSink = str[1];
 		}
-		if (addr % 0x2000 == 0) MESS(".");	/* Display progress indicator at every 8K byte */
-		addr += 1024;
-	} while (addr < Device->FlashSize);
-
-	MESS("passed.\n");
+		test_speed(set ? "encode (SSSE3)" : "encode (scalar)", get_time() - t, n * (double)(TEST_SIZE / 45 * 45));
+	}
+	UuSimd = simd;
+	uuencode(buf, 45, str);
+	for (n = 0, t = get_time(); get_time() - t < TEST_TIME; n++) {
+		for (i = 0; i + 45 <= TEST_SIZE; i += 45) TestSink = uudecode(str, &buf[i]);
+	}
+	test_speed("decode", get_time() - t, n * (double)(TEST_SIZE / 45 * 45));
 
-	return 0;
+	return err;
 }
 
 
-
-
+/* Write the test data in hex file (0:Intel HEX 32-byte records, 1:Intel HEX 16-byte records in lower case with CRLF, 2:S3 records) */
 static
-int erase_flash (
-	// HANDLE com
-	int com
+void test_put_hex (
+	FILE* fp,
+	const uint8_t* buf,		/* Test data (TEST_SIZE, repeated) */
+	int set
 )
 {
-	uint32_t es, n;
-	char buf[80];
-	// COMMTIMEOUTS ct1 = { 0, 1, 2000, 1, 250},
-				//  ct2 = { 0, 1, 500, 1, 500};
-
-
-	MESS("Erasing.");
+	const char *fmt = (set == 1) ? "%02x" : "%02X", *eol = (set == 1) ? "\r\n" : "\n";
+	uint32_t a, i, n, sum;
 
-	/* End sector is last sector of the device */
-	es = adr2sect(Device->FlashSize - 1);
 
-	/* Prepare to write/erase sectors */
-	sprintf(buf, "P 0 %u%s", es, Del);
-	// WriteFile(com, buf, strlen(buf), &n, NULL);
-	n = write(com, buf, strlen(buf));
-	MESS(".");
-	if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-		fprintf(stderr, "failed(P,%s).\n", buf);
-		return 12;
+	n = (set == 1) ? 16 : 32;	/* Bytes per record */
+	for (a = 0; a < TEST_HEX; a += n) {
+		if (set == 2) {
+			sum = (n + 5) + (a >> 24) + (a >> 16 & 0xFF) + (a >> 8 & 0xFF) + (a & 0xFF);
+			fprintf(fp, "S3%02X%08X", n + 5, a);
+		} else {
+			if (a % 0x10000 == 0) fprintf(fp, ":02000004%04X%02X%s", a >> 16, (0x100 - (6 + (a >> 24) + (a >> 16 & 0xFF))) & 0xFF, eol);
+			sum = n + (a >> 8 & 0xFF) + (a & 0xFF);
+			fprintf(fp, ":%02X%04X00", n, a & 0xFFFF);
+		}
+		for (i = 0; i < n; i++) {
+			fprintf(fp, fmt, buf[(a + i) % TEST_SIZE]);
+			sum += buf[(a + i) % TEST_SIZE];
+		}
+		fprintf(fp, fmt, (set == 2) ? ~sum & 0xFF : (0x100 - (sum & 0xFF)) & 0xFF);
+		fputs(eol, fp);
 	}
+	fprintf(fp, (set == 2) ? "S70500000000FA%s" : ":00000001FF%s", eol);
+}
 
-	// SetCommTimeouts(com, &ct1);	/* Set processing timeout of 2 sec */
-	timeout.tv_sec = 2;
-	timeout.tv_usec = 0;
-	/* Erase sectors */
-	sprintf(buf, "E 0 %u%s", es, Del);
-	// WriteFile(com, buf, strlen(buf), &n, NULL);
-	n = write(com, buf, strlen(buf));
-	MESS(".");
-	if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-		fprintf(stderr, "failed(E,%s).\n", buf);
-		return 12;
-	}
-	// SetCommTimeouts(com, &ct2);	/* Restore processing timeout */
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 500 * 1000;
 
-	MESS("passed.\n");
-	return 0;
-}
+/* Release the data image loaded by the test */
+static
+void test_free_image (void)
+{
+	uint32_t p;
 
 
+	for (p = 0; p < MAX_IMAGE / IMG_PAGE; p++) free(Image[p]);
+	clear_image();
+}
 
 
+/* Load multi-megabyte hex files, check the image and measure the throughput */
 static
-int write_flash (
-	// HANDLE com,
-	int com,
-	const uint8_t* buffer
+int test_hex (			/* Number of errors */
+	uint8_t* buf		/* Work buffer (TEST_SIZE) */
 )
 {
-	uint32_t wa, pc, n, lc, cc, xc, sum;
-	char buf[80], *tp;
-
-
-	MESS("Writing.");
+	static const char* const name[3] = { "Intel HEX (32, LF)", "Intel HEX (16, CRLF, lc)", "S-record (S3, 32)" };
+	uint8_t blk[4096];
+	FILE *fp;
+	HEXSTATE hs;
+	char *text;
+	size_t size;
+	uint32_t a;
+	long n;
+	int set, k, mapped, err = 0;
+	double t, tb[3];
 
-	wa = (AddrRange[1] + Device->XferSize) & ~(Device->XferSize - 1);	/* Write from high address block */
-	pc = 0;
 
-	while (wa > 0) {
-		wa -= Device->XferSize;
-		/* Send a data block to SRAM */
-		sprintf(buf, "W %u %u%s", Device->XferAddr, Device->XferSize, Del);
-		// WriteFile(com, buf, strlen(buf), &n, NULL);
-		n = write(com, buf, strlen(buf));
-		if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-			fprintf(stderr, "failed(W,%s).\n", buf);
-			return 13;
+	test_pattern(buf, TEST_SIZE);
+	for (set = 0; set < 3; set++) {
+		tb[set] = 0;
+		fp = tmpfile();
+		if (!fp) {
+			err++;
+			continue;
 		}
-		if (Device->RawMode) {	/* Raw mode transfer */
-			// WriteFile(com, &buffer[wa], Device->XferSize, &xc, NULL);	/* Send data */
-			xc = write(com, &buffer[wa], Device->XferSize); /* Send data */
-			/* Check if data has been sent with no error */
-			sprintf(buf, "S %u %u%s", Device->XferAddr, Device->XferSize, Del);
-			// WriteFile(com, buf, strlen(buf), &n, NULL);
-			n = write(com, buf, strlen(buf));
-			if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0") ||
-				!rcvr_line(com, buf, sizeof buf) || strtoul(buf, &tp, 10) != crc32(&buffer[wa], Device->XferSize)
-				) {
-				fprintf(stderr, "failed(S,%s).\n", buf);
-				return 13;
-			}
-		} else {				/* Text mode transfer */
-			for (xc = lc = sum = 0; xc < Device->XferSize; xc += cc) {
-				if (xc + 45 <= Device->XferSize) {
-					cc = 45;
-					lc++;
-				} else {
-					cc = Device->XferSize - xc;
-					lc = 20;
-				}
-				uuencode(&buffer[wa+xc], cc, buf);
-				strcat(buf, Del);
-				// WriteFile(com, buf, strlen(buf), &n, NULL);
-				n = write(com, buf, strlen(buf));
-				for (n = 0; n < cc; n++) sum += buffer[wa + xc + n];
-				if (lc == 20) {
-					sprintf(buf, "%u%s", sum, Del);
-					// WriteFile(com, buf, strlen(buf), &n, NULL);
-					n = write(com, buf, strlen(buf));
-					if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "OK")) {
-						fprintf(stderr, "failed(%s).\n", buf);
-						return 13;
-					}
-					lc = sum = 0;
-				}
+		test_put_hex(fp, buf, set);
+		fflush(fp);
+		for (k = 0; k < 3; k++) {	/* Best of three loads (same steps as load_file) */
+			test_free_image();
+			t = get_time();
+			text = map_file(fileno(fp), &size, &mapped);
+			if (!text) {
+				n = -1;
+			} else {
+				memset(&hs, 0, sizeof hs);
+				n = parse_hex(text, size, &hs);
+				unmap_file(text, size, mapped);
 			}
+			if (!n && commit_image(&a)) n = -3;
+			t = get_time() - t;
+			if (n) break;
+			if (!k || t < tb[set]) tb[set] = t;
 		}
-		/* Prepare a sector to write flash */
-		sprintf(buf, "P %u %u%s", adr2sect(wa), adr2sect(wa), Del);
-		// WriteFile(com, buf, strlen(buf), &n, NULL);
-		n = write(com, buf, strlen(buf));
-		if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-			fprintf(stderr, "failed(P,%s).\n", buf);
-			return 13;
-		}
-		/* Copy RAM to flash */
-		sprintf(buf, "C %u %u %u%s", wa, Device->XferAddr, Device->XferSize, Del);
-		// WriteFile(com, buf, strlen(buf), &n, NULL);
-		n = write(com, buf, strlen(buf));
-		if (!rcvr_line(com, buf, sizeof buf) || strcmp(buf, "0")) {
-			fprintf(stderr, "failed(C,%s).\n", buf);
-			return 13;
+		fclose(fp);
+		if (n || AddrRange[0] != 0 || AddrRange[1] != TEST_HEX - 1) err++;
+		for (a = 0; !n && a < TEST_HEX; a += sizeof blk) {
+			read_image(a, blk, sizeof blk);
+			if (memcmp(blk, &buf[a % TEST_SIZE], sizeof blk)) {
+				err++;
+				break;
+			}
 		}
-
-		if (pc % 0x2000 == 0) MESS(".");	/* Display a progress indicator every 8K byte */
-		pc += Device->XferSize;
+		tb[set] = n ? 0 : size / tb[set];
+		test_free_image();
+	}
+	printf("Hex loader: %s (%u KB data)\n", err ? "NG" : "OK", TEST_HEX / 1024);
+	for (set = 0; set < 3; set++) {
+		if (tb[set] > 0) test_speed(name[set], 1, tb[set]);
 	}
 
-	MESS("passed.\n");
-	return 0;
+	return err;
 }
 
 
-
-void _pause (
-	int rc
-)
+/* Run the self test */
+static
+int self_test (void)	/* 0:passed, 1:failed */
 {
-	if ((Pause == 2) || ((Pause == 1) && rc)) {
-		MESS("\nType Enter to exit...");
-		getchar();
-	}
+	uint8_t *buf;
+	int err;
+
+
+	buf = malloc(TEST_SIZE);
+	if (!buf) return 1;
+	err = test_crc(buf);
+	err += test_uucode(buf);
+	err += test_hex(buf);
+	free(buf);
+	return err ? 1 : 0;
 }
 
 
 
+
 int main (int argc, char** argv)
 {
-	int rc;
-	uint32_t s, n, i, d;
+	int rc, n;
 	// HANDLE hcom;
-	int hcom;
+	SESSION *ses = &Session[0];
+	pthread_t th[MAX_PORT];
+	int run[MAX_PORT];
 
 
+	init_crc();
+	init_uucode();
 	rc = load_commands(argc, argv);
+	if (!rc && SelfTest) return self_test();
 	fprintf(stderr, "port = %s\n", Port);;
 	fprintf(stderr, "baud = %d\n", Baud);;
 	fprintf(stderr, "Pol = %d\n", Pol);;
+	if (!rc) rc = init_sessions();
+	if (!rc) load_syncs();
 	if (rc) {
 		if (rc == 1) MESS(Usage);
 		_pause(rc);
 		return rc;
 	}
-	if (Read) {	/* Read mode */
-		// rc = enter_ispmode(&hcom);
-		rc = enter_ispmode(&hcom);
-		if (!rc) {
-			rc = read_flash(hcom, Buffer);
-			if (!rc) {
-				/* Check if application code is exist (sum of eight vector data) */
-				for (i = n = 0; i < 32; i += 4) {
-					n += LD_DWORD(&Buffer[i]);
-				}
-				if (n) {
-					MESS("There is no valid program code.\n");
-				} else {
-					for (i = n = 0; i < Device->FlashSize; i += 4) {
-						if (LD_DWORD(&Buffer[i]) != 0xFFFFFFFF) n = i + 4;
-					}
-					d = n * 1000 / Device->FlashSize;
-					fprintf(stderr, " %u.%u%% of flash memory is used.\n", d / 10, d % 10);
-				}
-				output_ihex(stdout, Buffer, Device->FlashSize, 32);
-			}
-			exit_ispmode(hcom);
-		}
-	} else {	/* Write mode */
-		if (AddrRange[1] == 0) {	/* Check if any data is loaded */
-			MESS(Usage);
+	if (ServeSock[0]) {	/* Daemon mode */
+		if (Streaming) {
+			MESS("A streamed file cannot be used in daemon mode.\n");
 			_pause(1);
 			return 1;
 		}
-		fprintf(stderr, "Loaded address range is %05X-%05X.\n", AddrRange[0], AddrRange[1]);
-		if (AddrRange[0] != 0) {	/* Check if vector area is loaded */
-			MESS("Vector table is not loaded.\n");
+		DefVerify = Verify; DefVerifyOpt = VerifyOpt; DefDiff = Diff; DefEraseAll = EraseAll; DefCrp3 = Crp3;
+		rc = serve_jobs();
+	} else if (Read) {	/* Read mode */
+		if (Gang) {
+			MESS("Read operation can be done with only a port.\n");
 			_pause(1);
 			return 1;
 		}
-		rc = enter_ispmode(&hcom);	/* Open port, enter ispmode and detect device type */
-		if (!rc) {
-			if (AddrRange[1] >= Device->FlashSize) {
-				MESS("Too large data for this device.\n");
+		// rc = enter_ispmode(&hcom);
+		rc = read_target(ses, stdout);
+	} else {	/* Write mode */
+		if (Streaming) {	/* The data is checked by each session as it arrives */
+			if (start_stream()) {
+				MESS("Failed to start streaming.\n");
+				_pause(2);
+				return 2;
+			}
+		} else {
+			if (AddrRange[1] == 0) {	/* Check if any data is loaded */
+				MESS(Usage);
 				_pause(1);
 				return 1;
 			}
-			s = LD_DWORD(&Buffer[Device->CRP]);
-			if (!Crp3 && (s == 0x43218765 || s == 0x4E697370)) {
-				MESS("Programming aborted due to CRP3 or NO_ISP.\nSpecify -3 to force program these CRP options.\n");
+			fprintf(stderr, "Loaded address range is %05X-%05X.\n", AddrRange[0], AddrRange[1]);
+			if (AddrRange[0] != 0) {	/* Check if vector area is loaded */
+				MESS("Vector table is not loaded.\n");
 				_pause(1);
 				return 1;
 			}
-			/* Validate application code (create check sum) */
-			for (i = s = 0; i < 32; i += 4) {
-				s += LD_DWORD(&Buffer[i]);
+		}
+		if (!Gang) {
+			program_target(ses);
+			rc = ses->Rc;
+		} else {	/* Gang mode: program all targets in parallel with the shared data */
+			fprintf(stderr, "Programming %d targets in parallel...\n", Sessions);
+			for (n = 0; n < Sessions; n++) {
+				run[n] = !pthread_create(&th[n], NULL, program_target, &Session[n]);
+				if (!run[n]) {
+					Session[n].Rc = 7;
+					strcpy(Session[n].Msg, "failed to create thread.");
+					if (Streaming) stream_release(&Session[n], 0xFFFFFFFF);
+				}
+			}
+			for (n = 0; n < Sessions; n++) {
+				if (run[n]) pthread_join(th[n], NULL);
 			}
-			i = Device->Sum;
-			n = LD_DWORD(&Buffer[i]) - s;
-			ST_DWORD(&Buffer[i], n);
-			/* Erase entire flash memory and write application code */
-			rc = erase_flash(hcom);
-			if (!rc) rc = write_flash(hcom, Buffer);
-			exit_ispmode(hcom);
+			rc = report_gang();
 		}
+		if (Streaming) rc = end_stream(rc);
+	}
+
+	save_syncs();
+	save_uids();
+	if (Stats) report_stats();
+	if (StatsFile[0] && write_stats(StatsFile)) {
+		fprintf(stderr, "Failed to write statistics to %s.\n", StatsFile);
 	}
 
 	_pause(rc);
 	return rc;
 }
-